@@ -1,10 +1,18 @@
 #include <algorithm>
+#include <chrono>
+#include <limits>
 #include <vector>
 
 #include "ai.h"
+#include "thread_pool.h"
 
+// Dist is the type of a distance: uint16_t on fields of up to 65533 cells,
+// which halves the memory a wave runs over, int on bigger ones.
+template <typename Dist>
 class Wave {
-  enum { target, undefined = 888888, obstacle = 999999 };
+  static constexpr Dist target = 0;
+  static constexpr Dist undefined = std::numeric_limits<Dist>::max() - 1;
+  static constexpr Dist obstacle = std::numeric_limits<Dist>::max();
 
  public:
   Wave(const Field &field)
@@ -63,8 +71,10 @@ class Wave {
   void build_wave(int src, int dst, bool *dst_reached) {
     *dst_reached = false;
     std::vector<int> array;
+    std::vector<bool> queued(data.size());
     size_t i = 0;
     array.push_back(dst);
+    queued[dst] = true;
     while (i < array.size()) {
       auto cell = array[i++];
       for (auto &d : dirs) {
@@ -78,7 +88,8 @@ class Wave {
             if (data[next] > data[cell] + 1) {
               data[next] = data[cell] + 1;
             }
-            if (std::find(array.begin(), array.end(), next) == array.end()) {
+            if (!queued[next]) {
+              queued[next] = true;
               array.push_back(next);
             }
           }
@@ -99,38 +110,626 @@ class Wave {
   void set_undefined(int pos) { data[pos] = undefined; }
 
  private:
-  std::vector<int> data;
+  std::vector<Dist> data;
   const std::vector<Dir> dirs;
   const Field &f;
 };
 
-GameAI::GameAI(Game &game) : g(game) {}
+static Dir dir_to(const Field &f, int from, int to) {
+  for (auto dir : {Dir::Left, Dir::Right, Dir::Up, Dir::Down}) {
+    if (f.can_move(from, dir) && from + f.move_value(dir) == to) {
+      return dir;
+    }
+  }
+  return Dir::Err;
+}
+
+const std::vector<std::string> &ai_names() {
+  static const std::vector<std::string> names = {"waves", "hamilton",
+                                                 "search"};
+  return names;
+}
+
+std::unique_ptr<SnakeAI> create_ai(const std::string &name, Game &game) {
+  if (name == "waves") {
+    return std::make_unique<GameAI>(game);
+  }
+  if (name == "hamilton") {
+    return std::make_unique<HamiltonAI>(game);
+  }
+  if (name == "search") {
+    return std::make_unique<SearchAI>(game);
+  }
+  return nullptr;
+}
+
+// MARK: PathFinder
+
+PathFinder::PathFinder(const Field &field)
+    : f(field), seen(field.size().area()), stamp(0), total(0) {
+  int area = field.size().area();
+  if (area <= 65533) {
+    near_dist.resize(area);
+  } else {
+    far_dist.resize(area);
+  }
+}
+
+int PathFinder::estimate(int from, int to) const {
+  return std::abs(f.x(from) - f.x(to)) + std::abs(f.y(from) - f.y(to));
+}
+
+bool PathFinder::find(const Snake &snake, int src, int dst,
+                      std::vector<Dir> *path, long limit) {
+  return far_dist.empty() ? search(snake, src, dst, path, limit, near_dist)
+                          : search(snake, src, dst, path, limit, far_dist);
+}
+
+template <typename Dist>
+bool PathFinder::search(const Snake &snake, int src, int dst,
+                        std::vector<Dir> *path, long limit,
+                        std::vector<Dist> &dist) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  if (++stamp == 0) {
+    std::fill(seen.begin(), seen.end(), 0);
+    stamp = 1;
+  }
+  heap.clear();
+  seen[dst] = stamp;
+  dist[dst] = 0;
+  heap.push_back({estimate(dst, src), 0, dst});
+
+  // Goes on until every cell that can be on a shortest way is settled, so
+  // that the tie-breaking below sees all of them.
+  int found = -1;
+  long start = total;
+  while (!heap.empty() && (found < 0 || heap.front().f <= found)) {
+    std::pop_heap(heap.begin(), heap.end());
+    Node node = heap.back();
+    heap.pop_back();
+    if (node.g > dist[node.cell]) {
+      continue;
+    }
+    if (limit && total - start >= limit) {
+      return false;
+    }
+    total++;
+    for (auto dir : dirs) {
+      if (!f.can_move(node.cell, dir)) {
+        continue;
+      }
+      int next = node.cell + f.move_value(dir);
+      if (next == src) {
+        if (found < 0 || node.g + 1 < found) {
+          found = node.g + 1;
+        }
+        continue;
+      }
+      if (snake.contains(next, false)) {
+        continue;
+      }
+      int g = node.g + 1;
+      if (seen[next] != stamp || g < dist[next]) {
+        seen[next] = stamp;
+        dist[next] = g;
+        heap.push_back({g + estimate(next, src), g, next});
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+  }
+  if (found < 0) {
+    return false;
+  }
+
+  path->clear();
+  int cell = src;
+  for (int left = found; left > 0; left--) {
+    for (auto dir : dirs) {
+      if (!f.can_move(cell, dir)) {
+        continue;
+      }
+      int next = cell + f.move_value(dir);
+      if (next == dst ? left == 1
+                      : seen[next] == stamp && dist[next] == left - 1) {
+        path->push_back(dir);
+        cell = next;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+// MARK: FreeSpace
+
+FreeSpace::FreeSpace(const Field &field)
+    : f(field),
+      lab(field.size().area()),
+      sizes(field.size().area() + 1),
+      seen(field.size().area()),
+      stamp(0) {}
+
+void FreeSpace::reset(const Snake &snake) {
+  int area = f.size().area();
+  for (int i = 0; i < area; ++i) {
+    lab[i] = snake.contains(i, true) ? 0 : -1;
+  }
+  unused.clear();
+  for (int i = area; i > 0; --i) {
+    unused.push_back(i);
+  }
+  for (int i = 0; i < area; ++i) {
+    if (lab[i] < 0) {
+      int label = new_label();
+      sizes[label] = fill(i, label);
+    }
+  }
+}
+
+void FreeSpace::advance(int head, int old_tail, bool grown) {
+  if (!grown) {
+    release(old_tail);
+  }
+  occupy(head);
+}
+
+// Ways may run through the tail cell, it is gone by the time the head
+// gets there.
+bool FreeSpace::is_reachable(const Snake &snake, int cell) const {
+  return touches(snake.head(), cell) ||
+         (touches(snake.tail(), cell) && is_tail_in_sight(snake));
+}
+
+bool FreeSpace::is_tail_in_sight(const Snake &snake) const {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  int tail = snake.tail();
+  for (auto dir : dirs) {
+    if (!f.can_move(tail, dir)) {
+      continue;
+    }
+    int next = tail + f.move_value(dir);
+    if (next == snake.head() ||
+        (lab[next] != 0 && touches(snake.head(), next))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether cell is next to dst or to a free cell of its region.
+bool FreeSpace::touches(int cell, int dst) const {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  for (auto dir : dirs) {
+    if (!f.can_move(cell, dir)) {
+      continue;
+    }
+    int next = cell + f.move_value(dir);
+    if (next == dst || (lab[next] != 0 && lab[next] == lab[dst])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void FreeSpace::occupy(int cell) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  int label = lab[cell];
+  if (label == 0) {
+    return;
+  }
+  lab[cell] = 0;
+  if (--sizes[label] == 0) {
+    unused.push_back(label);
+    return;
+  }
+  if (!splits(cell)) {
+    return;
+  }
+  // The ring test can't see a loop around the cell, so each neighbour
+  // still labelled the old way is first searched from until it meets all
+  // the others; only a part that doesn't gets a label of its own.
+  int nb[4];
+  int count = 0;
+  for (auto dir : dirs) {
+    if (f.can_move(cell, dir) && lab[cell + f.move_value(dir)] == label) {
+      nb[count++] = cell + f.move_value(dir);
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    if (lab[nb[i]] != label) {
+      continue;
+    }
+    int rest[3];
+    int left = 0;
+    for (int j = i + 1; j < count; ++j) {
+      if (lab[nb[j]] == label) {
+        rest[left++] = nb[j];
+      }
+    }
+    if (left == 0 || reaches(nb[i], rest, left)) {
+      break;
+    }
+    int part = new_label();
+    for (int c : queue) {
+      lab[c] = part;
+    }
+    sizes[part] = queue.size();
+    sizes[label] -= sizes[part];
+  }
+}
+
+// Searches the region of from until all count cells are found. If they
+// aren't, the queue holds the whole part of the region around from.
+bool FreeSpace::reaches(int from, const int *cells, int count) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  if (++stamp == 0) {
+    std::fill(seen.begin(), seen.end(), 0);
+    stamp = 1;
+  }
+  int label = lab[from];
+  int found = 0;
+  queue.clear();
+  queue.push_back(from);
+  seen[from] = stamp;
+  for (size_t i = 0; i < queue.size(); ++i) {
+    int cell = queue[i];
+    for (auto dir : dirs) {
+      if (!f.can_move(cell, dir)) {
+        continue;
+      }
+      int next = cell + f.move_value(dir);
+      if (lab[next] != label || seen[next] == stamp) {
+        continue;
+      }
+      seen[next] = stamp;
+      queue.push_back(next);
+      if (std::find(cells, cells + count, next) != cells + count &&
+          ++found == count) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void FreeSpace::release(int cell) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  int keep = 0;
+  for (auto dir : dirs) {
+    if (!f.can_move(cell, dir)) {
+      continue;
+    }
+    int label = lab[cell + f.move_value(dir)];
+    if (label != 0 && (keep == 0 || sizes[label] > sizes[keep])) {
+      keep = label;
+    }
+  }
+  if (keep == 0) {
+    keep = new_label();
+    sizes[keep] = 0;
+  }
+  for (auto dir : dirs) {
+    if (!f.can_move(cell, dir)) {
+      continue;
+    }
+    int next = cell + f.move_value(dir);
+    int label = lab[next];
+    if (label != 0 && label != keep) {
+      sizes[keep] += fill(next, keep);
+      unused.push_back(label);
+    }
+  }
+  lab[cell] = keep;
+  sizes[keep]++;
+}
+
+// Whether the free neighbours of cell could lose touch with each other
+// when it is taken: they can't if they all lie in one unbroken run of free
+// cells on the ring of 8 around it.
+bool FreeSpace::splits(int cell) const {
+  static const int dx[] = {0, 1, 1, 1, 0, -1, -1, -1};
+  static const int dy[] = {-1, -1, 0, 1, 1, 1, 0, -1};
+  int x = f.x(cell);
+  int y = f.y(cell);
+  bool free[8];
+  for (int i = 0; i < 8; ++i) {
+    int nx = x + dx[i];
+    int ny = y + dy[i];
+    free[i] = nx >= 0 && ny >= 0 && nx < f.size().width() &&
+              ny < f.size().height() && lab[f.cell(nx, ny)] != 0;
+  }
+  int runs = 0;
+  for (int i = 0; i < 8; ++i) {
+    if (!free[i] || free[(i + 7) % 8]) {
+      continue;
+    }
+    bool side = false;
+    for (int j = i; j < i + 8 && free[j % 8]; ++j) {
+      side = side || j % 2 == 0;
+    }
+    runs += side;
+  }
+  return runs > 1;
+}
+
+// Gives label to the region around from, returns its size.
+int FreeSpace::fill(int from, int label) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  int old = lab[from];
+  queue.clear();
+  queue.push_back(from);
+  lab[from] = label;
+  for (size_t i = 0; i < queue.size(); ++i) {
+    int cell = queue[i];
+    for (auto dir : dirs) {
+      if (!f.can_move(cell, dir)) {
+        continue;
+      }
+      int next = cell + f.move_value(dir);
+      if (lab[next] == old) {
+        lab[next] = label;
+        queue.push_back(next);
+      }
+    }
+  }
+  return queue.size();
+}
+
+int FreeSpace::new_label() {
+  int label = unused.back();
+  unused.pop_back();
+  return label;
+}
+
+// MARK: Endgame
+
+Endgame::Endgame(const Field &field)
+    : f(field), bit(field.size().area()), depth(0), total(0), stop(0) {}
+
+bool Endgame::solve(const Snake &snake, long limit, std::vector<Dir> *path) {
+  static const Dir dirs[] = {Dir::Left, Dir::Right, Dir::Up, Dir::Down};
+  int area = f.size().area();
+  int n = area - snake.size();
+  if (n < 1 || n > max_cells) {
+    return false;
+  }
+  n = 0;
+  for (int cell = 0; cell < area; ++cell) {
+    bit[cell] = snake.contains(cell, true) ? -1 : n;
+    if (bit[cell] >= 0) {
+      cells[n++] = cell;
+    }
+  }
+  int head = n;
+  cells[head] = snake.head();
+  bit[snake.head()] = head;
+
+  white = 0;
+  for (int i = 0; i <= head; ++i) {
+    int cell = cells[i];
+    if ((f.x(cell) + f.y(cell)) % 2 == 0) {
+      white |= 1ull << i;
+    }
+    nbr[i] = 0;
+    for (auto dir : dirs) {
+      if (f.can_move(cell, dir) && bit[cell + f.move_value(dir)] >= 0) {
+        nbr[i] |= 1ull << bit[cell + f.move_value(dir)];
+      }
+    }
+  }
+  // The cell the tail is on is either still the tail at the end of the
+  // way or the first of the cells it has freed behind, and those stay
+  // free, so ending next to it keeps the tail in sight however many
+  // cookies are eaten on the way.
+  ends = 0;
+  for (auto dir : dirs) {
+    if (f.can_move(snake.tail(), dir)) {
+      int b = bit[snake.tail() + f.move_value(dir)];
+      if (b >= 0 && b != head) {
+        ends |= 1ull << b;
+      }
+    }
+  }
+
+  depth = 0;
+  stop = total + limit;
+  if (!search(head, (1ull << n) - 1)) {
+    return false;
+  }
+  path->clear();
+  int from = snake.head();
+  for (int i = 0; i < depth; ++i) {
+    path->push_back(dir_to(f, from, cells[way[i]]));
+    from = cells[way[i]];
+  }
+  return true;
+}
+
+bool Endgame::search(int at, uint64_t left) {
+  if (left == 0) {
+    return ends >> at & 1;
+  }
+  if (total++ >= stop || !may_cover(at, left)) {
+    return false;
+  }
+  // The cells with the fewest ways on first.
+  int next[4];
+  int ways[4];
+  int count = 0;
+  for (uint64_t m = nbr[at] & left; m; m &= m - 1) {
+    int b = __builtin_ctzll(m);
+    int w = __builtin_popcountll(nbr[b] & left);
+    int i = count++;
+    for (; i > 0 && ways[i - 1] > w; --i) {
+      next[i] = next[i - 1];
+      ways[i] = ways[i - 1];
+    }
+    next[i] = b;
+    ways[i] = w;
+  }
+  for (int i = 0; i < count; ++i) {
+    way[depth++] = next[i];
+    if (search(next[i], left & ~(1ull << next[i]))) {
+      return true;
+    }
+    depth--;
+  }
+  return false;
+}
+
+bool Endgame::may_cover(int at, uint64_t left) const {
+  if (!(left & ends)) {
+    return false;
+  }
+  // The way goes on from a neighbour of at, in the other colour, and
+  // alternates from there.
+  uint64_t same = (white >> at & 1) ? white : ~white;
+  int diff = __builtin_popcountll(left & ~same) -
+             __builtin_popcountll(left & same);
+  if (diff != 0 && diff != 1) {
+    return false;
+  }
+  // A cell with a single way in can only be the last one.
+  uint64_t around = left | 1ull << at;
+  int dead_ends = 0;
+  for (uint64_t m = left; m; m &= m - 1) {
+    int ways = __builtin_popcountll(nbr[__builtin_ctzll(m)] & around);
+    if (ways == 0 || (ways == 1 && ++dead_ends > 1)) {
+      return false;
+    }
+  }
+  uint64_t reach = nbr[at] & left;
+  for (uint64_t front = reach; front;) {
+    uint64_t grown = 0;
+    for (uint64_t m = front; m; m &= m - 1) {
+      grown |= nbr[__builtin_ctzll(m)];
+    }
+    front = grown & left & ~reach;
+    reach |= front;
+  }
+  return reach == left;
+}
+
+// MARK: GameAI
+
+GameAI::GameAI(Game &game)
+    : g(game), finder(game.field()), endgame(game.field()),
+      space(game.field()), sim(game.field()),
+      plan_pos(0), plan_cookie(-1), last_head(-1), last_size(0), budget(0),
+      move_start(0), decisions(0), budget_hits(0), endgames(0) {}
 
 bool GameAI::next_move() {
   Dir dir = find_move_dir();
   if (dir == Dir::Err) {
     return false;
   }
+  make_move(dir);
+  return true;
+}
+
+void GameAI::make_move(Dir dir) {
+  if (!plan.empty() && plan[plan_pos - 1] != dir) {
+    plan.clear();
+  }
+  int old_tail = g.snake().tail();
   bool cookie_eaten;
   g.move(dir, &cookie_eaten);
+  if (g.snake().head() != last_head) {
+    space.advance(g.snake().head(), old_tail, cookie_eaten);
+    last_head = g.snake().head();
+    last_size = g.snake().size();
+  }
+}
+
+Dir GameAI::find_move_dir() {
+  if (!in_sync()) {
+    space.reset(g.snake());
+    plan.clear();
+    last_head = g.snake().head();
+    last_size = g.snake().size();
+  }
+  decisions++;
+  if (has_plan()) {
+    return plan[plan_pos++];
+  }
+  plan.clear();
+  move_start = finder.expanded();
+  if (find_endgame()) {
+    return plan.front();
+  }
+  if (!space.is_reachable(g.snake(), g.cookie())) {
+    return follow_tail();
+  }
+  if (!finder.find(g.snake(), g.snake().head(), g.cookie(), &path,
+                   budget_left())) {
+    budget_hits += budget_spent();
+    return follow_tail();
+  }
+  return find_safe_way(path);
+}
+
+// What the finder may still expand on this move: 0 for no bound, and at
+// least 1 with one, so that a spent budget shows as a failed search.
+long GameAI::budget_left() const {
+  if (!budget) {
+    return 0;
+  }
+  return std::max(1L, budget - (finder.expanded() - move_start));
+}
+
+// Whether a budget is set and this move has used it up.
+bool GameAI::budget_spent() const {
+  return budget > 0 && finder.expanded() - move_start >= budget;
+}
+
+// With few cells left, a way through all of them that ends next to the
+// tail is looked for first. It holds whatever cookies come up, so it is
+// kept as the plan to its end. The search is cut at the budget of the
+// move, or at a fixed number of nodes without one, and the waves take
+// over if it finds nothing.
+bool GameAI::find_endgame() {
+  const long max_nodes = 200000;
+  int left = g.field().size().area() - g.snake().size();
+  if (left > Endgame::max_cells) {
+    return false;
+  }
+  long limit = budget ? budget_left() : max_nodes;
+  long start = endgame.nodes();
+  bool found = endgame.solve(g.snake(), limit, &plan);
+  // The nodes count against the budget of the move like expanded cells.
+  move_start -= endgame.nodes() - start;
+  if (!found) {
+    plan.clear();
+    return false;
+  }
+  endgames++;
+  plan_pos = 1;
+  plan_cookie = -1;
   return true;
 }
 
-Dir GameAI::find_move_dir() const {
-  bool has_way_to_cookie = is_reachable(g.snake().head(), g.cookie());
-  return has_way_to_cookie ? find_safe_way() : follow_tail();
+bool GameAI::in_sync() const {
+  return g.snake().head() == last_head && g.snake().size() == last_size;
 }
 
-bool GameAI::is_reachable(int src, int dst) const {
-  bool res;
-  Wave wave(g.field());
-  wave.reset(g.snake(), dst);
-  wave.build_wave(src, dst, &res);
-  return res;
+// The rest of a safe way stays good for as long as the game goes exactly
+// as it was played on the copy of the snake, so it is dropped only when
+// the cookie is gone (if the plan depends on it, plan_cookie -1 if not)
+// or the snake isn't where this AI left it.
+bool GameAI::has_plan() const {
+  if (plan_pos >= plan.size() ||
+      (plan_cookie >= 0 && g.cookie() != plan_cookie)) {
+    return false;
+  }
+  auto &s = g.snake();
+  Dir dir = plan[plan_pos];
+  return g.field().can_move(s.head(), dir) &&
+         !s.contains(s.head() + g.field().move_value(dir), false);
 }
 
-Dir GameAI::follow_tail() const {
-  Wave wave(g.field());
+template <typename Dist>
+static Dir longest_move_to_tail(const Game &g) {
+  Wave<Dist> wave(g.field());
   auto &s = g.snake();
   wave.reset(s, g.cookie());
   wave.set_target(s.tail());
@@ -140,31 +739,350 @@ Dir GameAI::follow_tail() const {
   return wave.longest_move(s.head());
 }
 
-Dir GameAI::find_safe_way() const {
-  Wave wave(g.field());
+Dir GameAI::follow_tail() const {
+  Dir res = g.field().size().area() <= 65533
+                ? longest_move_to_tail<uint16_t>(g)
+                : longest_move_to_tail<int>(g);
+  return res != Dir::Err ? res : find_roomiest_move();
+}
+
+// Plays the way to the cookie on a copy of the snake and only takes it if
+// the tail is still in sight from there. The way is planned again after
+// every step, as the cells the tail frees may open a shorter one. The
+// moves played are kept as the plan for the following moves, since they
+// are exactly what planning again from each of them would give.
+Dir GameAI::find_safe_way(const std::vector<Dir> &path) {
   Snake tmp_snake = g.snake();
-  wave.reset(tmp_snake, g.cookie());
-  Dir res = Dir::Err;
+  sim = space;
+  Dir dir = path.front();
   while (true) {
-    bool dummy;
-    wave.build_wave(tmp_snake.head(), g.cookie(), &dummy);
-    Dir move = wave.shortest_move(tmp_snake.head());
-    if (res == Dir::Err) {
-      res = move;
-    }
-    tmp_snake.move(move);
+    int old_tail = tmp_snake.tail();
+    plan.push_back(dir);
+    tmp_snake.move(dir);
     if (tmp_snake.head() == g.cookie()) {
       tmp_snake.grow();
+      sim.advance(tmp_snake.head(), old_tail, true);
       break;
-    } else {
-      wave.set_obstacle(tmp_snake.head());
-      wave.set_undefined(tmp_snake.cell(tmp_snake.size() - 1));
     }
+    sim.advance(tmp_snake.head(), old_tail, false);
+    if (!finder.find(tmp_snake, tmp_snake.head(), g.cookie(), &step,
+                     budget_left())) {
+      // Out of budget, or the cookie is cut off on the way: the part
+      // played so far has to do.
+      budget_hits += budget_spent();
+      plan.clear();
+      return sim.is_tail_in_sight(tmp_snake) ? path.front() : follow_tail();
+    }
+    dir = step.front();
   }
-  // We always have to keep the tail reachable from the head
-  if (wave.is_tail_in_sight(tmp_snake)) {  // TODO: check on every step of
-                                           // the find_safe_way() algirithm
-    return res;
+  if (sim.is_tail_in_sight(tmp_snake)) {
+    plan_pos = 1;
+    plan_cookie = g.cookie();
+    return plan.front();
   }
+  plan.clear();
   return follow_tail();
 }
+
+SnakeAI::Stats GameAI::stats() const {
+  long cells = finder.expanded() + endgame.nodes();
+  return {{"budget_hits", double(budget_hits)},
+          {"cells/move", decisions ? double(cells) / decisions : 0},
+          {"endgames", double(endgames)}};
+}
+
+// With the tail out of sight, heads for the biggest free region next to
+// the head, where the snake lasts longest.
+Dir GameAI::find_roomiest_move() const {
+  auto &s = g.snake();
+  Dir res = Dir::Err;
+  int room = 0;
+  for (auto dir : {Dir::Left, Dir::Right, Dir::Up, Dir::Down}) {
+    if (!g.field().can_move(s.head(), dir)) {
+      continue;
+    }
+    int next = s.head() + g.field().move_value(dir);
+    if (space.region(next) != 0 && space.region_size(next) > room) {
+      room = space.region_size(next);
+      res = dir;
+    }
+  }
+  return res;
+}
+
+// MARK: HamiltonAI
+
+HamiltonAI::HamiltonAI(Game &game) : g(game), fallback(game), aligned(false) {
+  build_cycle();
+}
+
+// With an even number of rows the rows are walked as a serpentine over
+// columns 1.., and column 0 leads back up; with an even number of columns
+// the same goes for the transposed field.
+void HamiltonAI::build_cycle() {
+  auto &f = g.field();
+  int w = f.size().width();
+  int h = f.size().height();
+  if (h % 2 == 0 && w > 1) {
+    for (int y = 0; y < h; y++) {
+      for (int i = 1; i < w; i++) {
+        cycle.push_back(f.cell(y % 2 ? w - i : i, y));
+      }
+    }
+    for (int y = h - 1; y >= 0; y--) {
+      cycle.push_back(f.cell(0, y));
+    }
+  } else if (w % 2 == 0 && h > 1) {
+    for (int x = 0; x < w; x++) {
+      for (int i = 1; i < h; i++) {
+        cycle.push_back(f.cell(x, x % 2 ? h - i : i));
+      }
+    }
+    for (int x = w - 1; x >= 0; x--) {
+      cycle.push_back(f.cell(x, 0));
+    }
+  } else {
+    return;
+  }
+
+  order.resize(cycle.size());
+  for (size_t i = 0; i < cycle.size(); i++) {
+    order[cycle[i]] = i;
+  }
+  // Run the cycle the way the snake is facing.
+  auto &s = g.snake();
+  if (dist(s.head(), s.cell(1)) == 1) {
+    std::reverse(cycle.begin(), cycle.end());
+    for (size_t i = 0; i < cycle.size(); i++) {
+      order[cycle[i]] = i;
+    }
+  }
+  aligned = is_aligned();
+}
+
+int HamiltonAI::dist(int from, int to) const {
+  int n = cycle.size();
+  int d = order[to] - order[from];
+  return d < 0 ? d + n : d;
+}
+
+// The shortcuts are only safe while the body runs from the tail to the
+// head in cycle order. A snake that doesn't start out like that gets
+// there by following the cycle for a while.
+bool HamiltonAI::is_aligned() const {
+  auto &s = g.snake();
+  int total = 0;
+  for (int i = 0; i + 1 < s.size(); i++) {
+    total += dist(s.cell(i + 1), s.cell(i));
+  }
+  return total < (int)cycle.size();
+}
+
+Dir HamiltonAI::find_move_dir() {
+  auto &f = g.field();
+  auto &s = g.snake();
+  int head = s.head();
+  int next = cycle[(order[head] + 1) % cycle.size()];
+  if (!aligned) {
+    aligned = is_aligned();
+    if (!aligned) {
+      return dir_to(f, head, next);
+    }
+  }
+
+  int to_tail = dist(head, s.tail());
+  int to_cookie = dist(head, g.cookie());
+  int best = 1;
+  for (auto dir : {Dir::Left, Dir::Right, Dir::Up, Dir::Down}) {
+    if (!f.can_move(head, dir)) {
+      continue;
+    }
+    int cell = head + f.move_value(dir);
+    int d = dist(head, cell);
+    if (d > best && d < to_tail && d <= to_cookie) {
+      best = d;
+      next = cell;
+    }
+  }
+  return dir_to(f, head, next);
+}
+
+bool HamiltonAI::next_move() {
+  if (!has_cycle()) {
+    return fallback.next_move();
+  }
+  Dir dir = find_move_dir();
+  if (dir == Dir::Err) {
+    return false;
+  }
+  bool cookie_eaten;
+  g.move(dir, &cookie_eaten);
+  return true;
+}
+
+// MARK: SearchAI
+
+struct SearchAI::Worker {
+  Worker(const Game &game) : game(game), ai(this->game) {}
+  Game game;
+  GameAI ai;
+};
+
+SearchAI::SearchAI(Game &game, unsigned threads, int budget)
+    : g(game),
+      lead(game),
+      pool(std::make_unique<ThreadPool>(threads)),
+      budget(budget),
+      depth(game.field().size().area()),
+      rng(2),
+      searches(0),
+      playouts(0),
+      nodes(0),
+      seconds(0),
+      worst(0),
+      late(0) {
+  for (unsigned i = 0; i < pool->size(); i++) {
+    workers.push_back(std::make_unique<Worker>(game));
+  }
+}
+
+SearchAI::~SearchAI() {}
+
+bool SearchAI::next_move() {
+  auto &f = g.field();
+  auto &s = g.snake();
+  std::vector<Dir> dirs;
+  for (auto dir : {Dir::Left, Dir::Right, Dir::Up, Dir::Down}) {
+    if (f.can_move(s.head(), dir) &&
+        !s.contains(s.head() + f.move_value(dir), false)) {
+      dirs.push_back(dir);
+    }
+  }
+  if (dirs.empty()) {
+    return false;
+  }
+  // GameAI's own move is decided within the budget too.
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::microseconds(budget);
+  Dir lead_dir = lead.find_move_dir();
+  size_t best = std::find(dirs.begin(), dirs.end(), lead_dir) - dirs.begin();
+  if (best == dirs.size()) {
+    best = 0;
+  }
+
+  if (dirs.size() > 1) {
+    int area = f.size().area();
+    // Each thread plays one playout of every move per round; the seeds are
+    // drawn here so that the games don't depend on which thread plays them.
+    size_t per_round = dirs.size() * workers.size();
+    std::vector<double> value(dirs.size());
+    std::vector<long> lost(dirs.size());
+    std::vector<double> round(per_round);
+    std::vector<long> moves(per_round);
+    std::vector<unsigned> seeds(per_round);
+    std::vector<char> done(per_round);
+    long searched = 0;
+    long counted = 0;
+    auto now = start;
+    std::chrono::steady_clock::duration took;
+    do {
+      for (auto &seed : seeds) {
+        seed = rng();
+      }
+      pool->parallel_for(workers.size(), [&](size_t w) {
+        for (size_t i = w * dirs.size(); i < (w + 1) * dirs.size(); i++) {
+          done[i] = play_out(*workers[w], dirs[i % dirs.size()], seeds[i],
+                             end, &round[i], &moves[i]);
+        }
+      });
+      // A round cut by the deadline favours the moves whose playouts were
+      // cut soonest, so only the first one, with nothing better to go on,
+      // counts.
+      bool whole = std::find(done.begin(), done.end(), 0) == done.end();
+      for (size_t i = 0; i < per_round; ++i) {
+        if (whole || !counted) {
+          value[i % dirs.size()] += round[i];
+          lost[i % dirs.size()] += round[i] < area;
+        }
+        searched += moves[i];
+      }
+      counted += whole || !counted;
+      playouts += per_round;
+      auto last = now;
+      now = std::chrono::steady_clock::now();
+      took = now - last;
+    } while (now + took < end);
+    double spent = std::chrono::duration<double>(now - start).count();
+    nodes += searched;
+    seconds += spent;
+    worst = std::max(worst, spent);
+    late += spent > budget * 1.25e-6;
+    searches++;
+    // Size the playouts so that each thread gets through a round, one
+    // playout of each of up to three moves, within the budget.
+    double rate = searched / spent / pool->size();
+    depth = std::clamp(int(rate * budget * 1e-6 / 3), 1, area);
+    // GameAI's move stays unless the snake lost most of its games and
+    // another move did clearly better, by half of them survived: the
+    // playouts only sample the cookies to come, and a move off GameAI's
+    // way drops the plan it has.
+    long games = counted * workers.size();
+    if (lost[best] * 2 > games) {
+      double bar = value[best] + games * area / 2.0;
+      for (size_t i = 0; i < dirs.size(); i++) {
+        if (value[i] > bar) {
+          bar = value[i];
+          best = i;
+        }
+      }
+    }
+  }
+  lead.make_move(dirs[best]);
+  return true;
+}
+
+// Plays the game on from dir until the snake dies or has made depth
+// moves, and returns false if the deadline cut it short; a cut playout
+// counts as one the snake survived. The worker's GameAI gets a work
+// budget of one field area per move, so that no single move of it runs
+// far past the deadline.
+bool SearchAI::play_out(Worker &w, Dir dir, unsigned seed,
+                        std::chrono::steady_clock::time_point end,
+                        double *value, long *moves) const {
+  Game &game = w.game;
+  game = g;
+  game.reseed(seed);
+  bool cookie_eaten;
+  game.move(dir, &cookie_eaten);
+  *moves = 1;
+  int area = game.field().size().area();
+  w.ai.restart();
+  w.ai.set_work_budget(area);
+  bool cut = false;
+  while (!game.is_over() && *moves < depth) {
+    if (std::chrono::steady_clock::now() >= end) {
+      cut = true;
+      break;
+    }
+    if (!w.ai.next_move()) {
+      break;
+    }
+    ++*moves;
+  }
+  *value = game.score() - g.score();
+  if (game.snake().size() == area) {
+    *value += 2 * area;
+  } else if (!game.is_over() && (cut || *moves == depth)) {
+    *value += area;
+  }
+  return !cut;
+}
+
+SnakeAI::Stats SearchAI::stats() const {
+  return {{"nodes/s", seconds > 0 ? nodes / seconds : 0},
+          {"playouts/move", searches ? double(playouts) / searches : 0},
+          {"worst_us", worst * 1e6},
+          {"late", double(late)}};
+}
+
+bool SearchAI::uses_threads() const { return pool->size() > 1; }
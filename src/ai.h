@@ -1,22 +1,288 @@
 #ifndef AI_H
 #define AI_H
 
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "game.h"
 
-class GameAI {
+class ThreadPool;
+
+// A way to play: next_move() makes one move on the game, or returns false
+// when it finds none.
+class SnakeAI {
+ public:
+  typedef std::vector<std::pair<std::string, double>> Stats;
+
+  virtual ~SnakeAI() {}
+  virtual bool next_move() = 0;
+  // Bounds the cells an AI may expand while deciding a move, 0 for no
+  // bound. AIs whose moves take little work anyway ignore it.
+  virtual void set_work_budget(long /*cells*/) {}
+  // Figures about the work done so far, by name.
+  virtual Stats stats() const { return {}; }
+  // Whether the AI works on threads of its own besides the calling one.
+  virtual bool uses_threads() const { return false; }
+  // Whether the next move follows from the game state alone, so that once
+  // a state comes back (Game::is_looping()) the game goes round the same
+  // loop for ever.
+  virtual bool decides_by_state() const { return false; }
+};
+
+// The strategies by name, "waves" first as the default; nullptr for an
+// unknown name.
+const std::vector<std::string> &ai_names();
+std::unique_ptr<SnakeAI> create_ai(const std::string &name, Game &game);
+
+// A* from the destination back to the source over the cells the snake
+// doesn't block (its tail moves away in time), guided by the Manhattan
+// distance to the source. The node arrays and the heap are kept between
+// searches and reset lazily by a search stamp, so a search only touches
+// the cells around the way it finds.
+class PathFinder {
+ public:
+  PathFinder(const Field &field);
+  // The moves from src to dst, or false if dst can't be reached, or not
+  // within limit expanded cells if there is one. Of the equally short ways
+  // it takes, like the waves, the first of Left, Right, Up, Down at every
+  // step.
+  bool find(const Snake &snake, int src, int dst, std::vector<Dir> *path,
+            long limit = 0);
+  // Cells expanded by all searches so far.
+  long expanded() const { return total; }
+
+ private:
+  struct Node {
+    int f;  // g + the estimate of what is left
+    int g;  // the distance to dst
+    int cell;
+    bool operator<(const Node &other) const {
+      return f != other.f ? f > other.f : g < other.g;
+    }
+  };
+
+  int estimate(int from, int to) const;
+  template <typename Dist>
+  bool search(const Snake &snake, int src, int dst, std::vector<Dir> *path,
+              long limit, std::vector<Dist> &dist);
+
+  const Field &f;
+  std::vector<uint16_t> seen;  // the search that last reached each cell
+  // The distances to dst, like the waves' 16-bit on fields of up to 65533
+  // cells; only the one that fits the field is allocated.
+  std::vector<uint16_t> near_dist;
+  std::vector<int> far_dist;
+  std::vector<Node> heap;
+  uint16_t stamp;
+  long total;
+};
+
+// The free cells of the field split into 4-connected regions, kept up to
+// date move by move: a cell the head takes can only split its region, and
+// then only when its free neighbours don't touch around it, so just that
+// region gets labelled again; a cell the tail frees merges the regions
+// around it into the biggest one. Snake cells, the tail too, have label 0.
+class FreeSpace {
+ public:
+  FreeSpace(const Field &field);
+  FreeSpace(const FreeSpace &other) = default;
+  // Copies the regions of another space over the same field.
+  FreeSpace &operator=(const FreeSpace &other) {
+    lab = other.lab;
+    sizes = other.sizes;
+    unused = other.unused;
+    return *this;
+  }
+  void reset(const Snake &snake);
+  // One snake move, after Snake::move (and Snake::grow if it has grown).
+  void advance(int head, int old_tail, bool grown);
+  int region(int cell) const { return lab[cell]; }
+  int region_size(int cell) const { return sizes[lab[cell]]; }
+  // Whether the head can get to cell, or next to the tail, over free cells.
+  bool is_reachable(const Snake &snake, int cell) const;
+  bool is_tail_in_sight(const Snake &snake) const;
+
+ private:
+  void occupy(int cell);
+  void release(int cell);
+  bool touches(int cell, int dst) const;
+  bool splits(int cell) const;
+  bool reaches(int from, const int *cells, int count);
+  int fill(int from, int label);
+  int new_label();
+
+  const Field &f;
+  std::vector<int> lab;
+  std::vector<int> sizes;   // cells in each region, by label
+  std::vector<int> unused;  // labels free for new regions
+  std::vector<int> queue;
+  std::vector<uint32_t> seen;  // the search that last reached each cell
+  uint32_t stamp;
+};
+
+// Exact play for the end of the game: a way from the head through every
+// free cell, the cookie among them, that ends next to the cell the tail is
+// on now. The cells are bits of a 64-bit set, so it takes at most 63 free
+// cells, and a depth-first search tries the cells with the fewest ways on
+// first and drops a branch as soon as the cells left can't all be walked:
+// when they aren't all reachable, when their colours on the checkerboard
+// don't alternate evenly, when two of them are dead ends or when none of
+// them is a cell to end on.
+class Endgame {
+ public:
+  enum { max_cells = 63 };
+
+  Endgame(const Field &field);
+  // False if there is no such way, or none found within limit nodes.
+  bool solve(const Snake &snake, long limit, std::vector<Dir> *path);
+  long nodes() const { return total; }
+
+ private:
+  bool search(int at, uint64_t left);
+  bool may_cover(int at, uint64_t left) const;
+
+  const Field &f;
+  std::vector<int> bit;   // bit of every free field cell, -1 for the others
+  int cells[max_cells + 1];  // field cell of every bit, the head last
+  uint64_t nbr[max_cells + 1];
+  uint64_t white;  // cells whose x + y is even
+  uint64_t ends;   // cells next to the tail
+  int way[max_cells];
+  int depth;
+  long total;
+  long stop;  // total at which the search gives up
+};
+
+class GameAI : public SnakeAI {
  public:
   GameAI(Game &game);
-  bool next_move();
+  bool next_move() override;
+  // next_move() in two steps, for an AI that plays through this one: the
+  // move it would make, Dir::Err for none, and then the move made, which
+  // may be another one; a plan holds only for the moves it was made of.
+  Dir find_move_dir();
+  void make_move(Dir dir);
+  // Forgets the state it left the game in, once the game has been set to
+  // another one.
+  void restart() { last_head = -1; }
+  // Once a move has taken its budget, the way to the cookie that is being
+  // checked is taken if the tail is in sight at the point reached.
+  void set_work_budget(long cells) override { budget = cells; }
+  // Not while it plays a way planned earlier.
+  bool decides_by_state() const override { return !has_plan(); }
+  // budget_hits are the moves cut short, cells/move the cells expanded,
+  // endgames the ways through the last free cells found.
+  Stats stats() const override;
 
  private:
-  bool is_reachable(int src, int dst) const;
-  Dir find_move_dir() const;
+  bool find_endgame();
+  long budget_left() const;
+  bool budget_spent() const;
+  bool in_sync() const;
+  bool has_plan() const;
   Dir follow_tail() const;
-  Dir find_safe_way() const;
+  Dir find_safe_way(const std::vector<Dir> &path);
+  Dir find_roomiest_move() const;
+
+  Game &g;
+  PathFinder finder;
+  Endgame endgame;
+  FreeSpace space;
+  FreeSpace sim;  // the space around the copy of the snake
+  std::vector<Dir> path;
+  std::vector<Dir> step;
+  // The safe way to the cookie found last, played from plan_pos on.
+  std::vector<Dir> plan;
+  size_t plan_pos;
+  int plan_cookie;
+  // Where this AI left the snake; space and plan hold only from there.
+  int last_head;
+  int last_size;
+  long budget;
+  long move_start;  // finder.expanded() when the move began
+  long decisions;
+  long budget_hits;
+  long endgames;
+};
+
+// Walks a Hamiltonian cycle of the field, cutting across it toward the
+// cookie only where the cut can't trap the snake: it has to land between
+// the head and the tail in cycle order and not past the cookie. So the
+// snake never runs into itself and always fills the whole field. Fields
+// with both sides odd have no such cycle and are left to GameAI.
+class HamiltonAI : public SnakeAI {
+ public:
+  HamiltonAI(Game &game);
+  bool next_move() override;
+  void set_work_budget(long cells) override {
+    fallback.set_work_budget(cells);
+  }
+  bool decides_by_state() const override {
+    return has_cycle() || fallback.decides_by_state();
+  }
+  bool has_cycle() const { return !cycle.empty(); }
+
+ private:
+  void build_cycle();
+  int dist(int from, int to) const;
+  bool is_aligned() const;
+  Dir find_move_dir();
+
+  Game &g;
+  GameAI fallback;
+  std::vector<int> cycle;  // cells in cycle order
+  std::vector<int> order;  // position of each cell on the cycle
+  bool aligned;
+};
+
+// Plays like GameAI, but first tries every move that doesn't run into the
+// snake by playing the game on from it with GameAI, each time with the
+// cookies coming from another seed. GameAI's move is only left when the
+// snake lost most of its games and another move's went clearly better:
+// the more cookies the better, but any game the snake survives beats one
+// it doesn't. Rounds of such
+// playouts run in parallel until the time budget of the move is spent, at
+// least one round per move; the playouts stop at the end of the budget
+// too. Every thread plays out on a game and a GameAI of its own that are
+// kept from move to move.
+class SearchAI : public SnakeAI {
+ public:
+  // threads 0 is one per core; budget is in microseconds.
+  SearchAI(Game &game, unsigned threads = 0, int budget = 2000);
+  ~SearchAI();
+  bool next_move() override;
+  // Bounds the cells of GameAI's own moves, not those of the playouts.
+  void set_work_budget(long cells) override { lead.set_work_budget(cells); }
+  // nodes/s are the moves played out per second of search, worst_us the
+  // longest search of a move, late the searches that ran over the budget
+  // by more than a quarter, as a busy machine alone can make some of them.
+  Stats stats() const override;
+  bool uses_threads() const override;
+
+ private:
+  struct Worker;
+
+  bool play_out(Worker &w, Dir dir, unsigned seed,
+                std::chrono::steady_clock::time_point end, double *value,
+                long *moves) const;
 
   Game &g;
+  GameAI lead;  // the moves taken where the playouts show nothing better
+  std::unique_ptr<ThreadPool> pool;
+  std::vector<std::unique_ptr<Worker>> workers;
+  int budget;
+  int depth;  // moves per playout
+  std::mt19937 rng;
+  long searches;
+  long playouts;
+  long nodes;
+  double seconds;
+  double worst;
+  long late;
 };
 
 #endif  // AI_H
\ No newline at end of file
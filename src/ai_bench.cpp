@@ -0,0 +1,240 @@
+// Plays every AI over the same fields and seeds, in parallel, and reports
+// how often and how fast each one fills the field. Games of AIs that work
+// on threads of their own are played one at a time afterwards, so that the
+// CPU time and heap of the whole process are theirs:
+//   snake_ai_bench [size=WxH ...] [ai=NAME ...] [seeds=N] [threads=N]
+//                  [budget=CELLS]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "ai.h"
+#include "game.h"
+#include "thread_pool.h"
+
+// MARK: Heap accounting
+
+// Every allocation carries its size in front, so each thread can keep its
+// own count of live bytes and their peak. While a game that runs on
+// threads of its own is played alone, the counts are the process's.
+namespace {
+thread_local long heap_now = 0;
+thread_local long heap_peak = 0;
+std::atomic<bool> heap_shared{false};
+std::atomic<long> shared_now{0};
+std::atomic<long> shared_peak{0};
+constexpr size_t heap_header = alignof(std::max_align_t);
+}  // namespace
+
+void *operator new(size_t size) {
+  auto p = static_cast<char *>(std::malloc(size + heap_header));
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  *reinterpret_cast<size_t *>(p) = size;
+  if (heap_shared.load(std::memory_order_relaxed)) {
+    long now = shared_now += size;
+    long peak = shared_peak.load();
+    while (now > peak && !shared_peak.compare_exchange_weak(peak, now)) {
+    }
+  } else {
+    heap_now += size;
+    if (heap_now > heap_peak) {
+      heap_peak = heap_now;
+    }
+  }
+  return p + heap_header;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept {
+  if (!ptr) {
+    return;
+  }
+  auto p = static_cast<char *>(ptr) - heap_header;
+  if (heap_shared.load(std::memory_order_relaxed)) {
+    shared_now -= *reinterpret_cast<size_t *>(p);
+  } else {
+    heap_now -= *reinterpret_cast<size_t *>(p);
+  }
+  std::free(p);
+}
+
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+// MARK: Runs
+
+// The CPU time of the calling thread, or of the whole process.
+double cpu_seconds(bool process) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  timespec ts;
+  clock_gettime(process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID,
+                &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+struct Job {
+  std::string ai;
+  Size size;
+  unsigned seed;
+  long budget;
+};
+
+struct Result {
+  long moves = 0;
+  bool completed = false;
+  double cpu = 0;
+  long peak_heap = 0;
+  SnakeAI::Stats stats;
+};
+
+// Long enough for any AI that makes progress; a snake that wanders
+// without repeating the game state (Game::is_looping()), or whose AI
+// doesn't decide by the state alone, is cut there.
+long move_limit(const Size &sz) {
+  long area = sz.area();
+  return area * area / 2 + 1000;
+}
+
+// alone: the game is the only one running, and its AI may use threads.
+Result play(const Job &job, bool alone) {
+  Result res;
+  heap_shared = alone;
+  long heap_base = alone ? shared_now.load() : heap_now;
+  if (alone) {
+    shared_peak = heap_base;
+  } else {
+    heap_peak = heap_base;
+  }
+  double start = cpu_seconds(alone);
+  {
+    Game game(job.size, job.seed);
+    auto ai = create_ai(job.ai, game);
+    ai->set_work_budget(job.budget);
+    long limit = move_limit(job.size);
+    while (!game.is_over() &&
+           !(game.is_looping() && ai->decides_by_state()) &&
+           res.moves < limit && ai->next_move()) {
+      res.moves++;
+    }
+    res.completed = game.snake().size() == job.size.area();
+    res.stats = ai->stats();
+  }
+  res.cpu = cpu_seconds(alone) - start;
+  res.peak_heap = (alone ? shared_peak.load() : heap_peak) - heap_base;
+  heap_shared = false;
+  return res;
+}
+
+// MARK: main
+
+int main(int argc, char **argv) {
+  std::vector<Size> sizes;
+  std::vector<std::string> names;
+  unsigned seeds = 8;
+  unsigned threads = 0;
+  long budget = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::smatch m;
+    if (std::regex_match(arg, m, std::regex("size=(\\d+)x(\\d+)"))) {
+      sizes.emplace_back(std::max(std::stoi(m[1]), 4),
+                         std::max(std::stoi(m[2]), 4));
+    } else if (std::regex_match(arg, m, std::regex("ai=(\\w+)"))) {
+      auto &all = ai_names();
+      if (std::find(all.begin(), all.end(), m[1]) == all.end()) {
+        std::fprintf(stderr, "unknown ai: %s\n", m[1].str().c_str());
+        return 1;
+      }
+      names.push_back(m[1]);
+    } else if (std::regex_match(arg, m, std::regex("seeds=(\\d+)"))) {
+      seeds = std::max(std::stoi(m[1]), 1);
+    } else if (std::regex_match(arg, m, std::regex("threads=(\\d+)"))) {
+      threads = std::stoi(m[1]);
+    } else if (std::regex_match(arg, m, std::regex("budget=(\\d+)"))) {
+      budget = std::stol(m[1]);
+    } else {
+      std::fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (sizes.empty()) {
+    sizes = {{6, 6}, {8, 8}, {13, 8}, {16, 12}};
+  }
+
+  if (names.empty()) {
+    names = ai_names();
+  }
+
+  std::vector<Job> jobs;
+  for (auto &name : names) {
+    for (auto &sz : sizes) {
+      for (unsigned seed = 1; seed <= seeds; seed++) {
+        jobs.push_back({name, sz, seed, budget});
+      }
+    }
+  }
+  // Which AIs work on threads of their own shows once they are created.
+  std::vector<size_t> shared, alone;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    Game game(jobs[i].size, jobs[i].seed);
+    (create_ai(jobs[i].ai, game)->uses_threads() ? alone : shared)
+        .push_back(i);
+  }
+  std::vector<Result> results(jobs.size());
+  ThreadPool pool(threads);
+  pool.parallel_for(shared.size(), [&](size_t i) {
+    results[shared[i]] = play(jobs[shared[i]], false);
+  });
+  for (size_t i : alone) {
+    results[i] = play(jobs[i], true);
+  }
+
+  std::printf("%-10s %7s %6s %10s %10s %12s %10s\n", "ai", "field", "runs",
+              "completed", "moves", "cpu/move", "peak heap");
+  for (size_t i = 0; i < jobs.size(); i += seeds) {
+    long moves = 0;
+    long peak = 0;
+    unsigned completed = 0;
+    double cpu = 0;
+    for (size_t j = i; j < i + seeds; j++) {
+      moves += results[j].moves;
+      completed += results[j].completed;
+      cpu += results[j].cpu;
+      peak = std::max(peak, results[j].peak_heap);
+    }
+    char field[16];
+    std::snprintf(field, sizeof(field), "%dx%d", jobs[i].size.width(),
+                  jobs[i].size.height());
+    std::printf("%-10s %7s %6u %9.0f%% %10ld %10.2fus %8.1fKB",
+                jobs[i].ai.c_str(), field, seeds, 100.0 * completed / seeds,
+                moves / seeds, moves ? cpu / moves * 1e6 : 0.0, peak / 1024.0);
+    // The AI's own figures, averaged over the runs.
+    auto &stats = results[i].stats;
+    for (size_t k = 0; k < stats.size(); k++) {
+      double sum = 0;
+      for (size_t j = i; j < i + seeds; j++) {
+        sum += results[j].stats[k].second;
+      }
+      std::printf(" %s=%.0f", stats[k].first.c_str(), sum / seeds);
+    }
+    std::printf("\n");
+  }
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <vector>
 
 #include "game.h"
@@ -39,58 +40,93 @@ int Field::move_value(Dir dir) const {
 // MARK: Snake
 
 Snake::Snake(const Field &field)
-    : cs(field.size().area() + 1), sz(0), f(field) {
+    : wide(field.size().area() > 0x10000), occ(field.size().area()), sz(0),
+      f(field) {
+  if (wide) {
+    cs32.resize(f.size().area() + 1);
+  } else {
+    cs16.resize(f.size().area() + 1);
+  }
   int len = 3;
   int y = f.size().height() / 2;
   for (int i = 0; i < len; ++i) {
-    cs[i] = f.cell(len - i, y);
+    set_cell(i, f.cell(len - i, y));
+    occ[cell(i)]++;
     sz++;
   }
 }
 
-// TODO:  (sort?), algorithm
 bool Snake::contains(int cell, bool test_tail) const {
-  int end = test_tail ? sz : sz - 1;
-  for (int i = 0; i < end; ++i) {
-    if (cs[i] == cell) {
-      return true;
-    }
-  }
-  return false;
+  return occ[cell] > (!test_tail && cell == tail() ? 1 : 0);
 }
 
-// TODO:  (sort?), algorithm
-bool Snake::eats_itself() const {
-  for (int i = 1; i < sz; ++i) {  // from 1
-    if (cs[i] == head()) {
-      return true;
-    }
-  }
-  return false;
-}
+bool Snake::eats_itself() const { return occ[head()] > 1; }
 
 void Snake::move(Dir dir) {
-  memmove(&cs[1], &cs[0], sz * sizeof(int));
-  cs[0] += f.move_value(dir);
+  int head = cell(0) + f.move_value(dir);
+  occ[tail()]--;
+  if (wide) {
+    memmove(&cs32[1], &cs32[0], sz * sizeof(cs32[0]));
+  } else {
+    memmove(&cs16[1], &cs16[0], sz * sizeof(cs16[0]));
+  }
+  set_cell(0, head);
+  occ[head]++;
 }
 
 void Snake::grow() {
-  if (sz < cs.size()) {
+  if (sz < f.size().area()) {
+    occ[cell(sz)]++;
     sz++;
   }
 }
 
+void Snake::set_cell(int i, int cell) {
+  if (wide) {
+    cs32[i] = cell;
+  } else {
+    cs16[i] = cell;
+  }
+}
+
 // MARK: Game
 
-Game::Game(Size field_size)
+namespace {
+
+enum { head_key = 1, link_key, cookie_key };
+
+// The random number for a kind of key at a cell, or for a link between two
+// cells, by the splitmix64 finalizer.
+uint64_t zobrist(uint64_t kind, uint64_t cell, uint64_t next = 0) {
+  uint64_t z = kind << 58 ^ cell << 29 ^ next;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+}  // namespace
+
+Game::Game(Size field_size, unsigned seed)
     : f(field_size),
       s(f),
       cooky(0),
       scr(0),
       over(false),
-      mt(2)
+      mt(seed),
+      hsh(0),
+      mark(0),
+      mark_age(0),
+      mark_span(1),
+      looping(false)
 {
+  // The head and the links from every cell to the next one pin the whole
+  // snake down.
+  hsh = zobrist(head_key, s.head()) ^ zobrist(cookie_key, cooky);
+  for (int i = 0; i + 1 < s.size(); ++i) {
+    hsh ^= zobrist(link_key, s.cell(i), s.cell(i + 1));
+  }
   new_cookie();
+  mark = hsh;
 }
 
 void Game::move(Dir dir, bool *cookie_eaten) {
@@ -103,21 +139,48 @@ void Game::move(Dir dir, bool *cookie_eaten) {
     return;
   }
 
+  int head = s.head();
+  int tail = s.tail();
+  int last_link = s.cell(s.size() - 2);
   s.move(dir);
+  hsh ^= zobrist(head_key, head) ^ zobrist(head_key, s.head()) ^
+         zobrist(link_key, s.head(), head) ^
+         zobrist(link_key, last_link, tail);
   *cookie_eaten = s.head() == cooky;
 
   if (*cookie_eaten) {
     scr += 1;
     s.grow();
+    hsh ^= zobrist(link_key, last_link, tail);
     if (s.size() < f.size().area()) {
       new_cookie();
     } else {
       over = true;
     }
+    mark = hsh;
+    mark_age = 0;
+    mark_span = 1;
+    looping = false;
+  } else {
+    check_loop();
   }
 }
 
-void Game::new_cookie() { cooky = random_free_cell(); }
+void Game::check_loop() {
+  if (hsh == mark) {
+    looping = true;
+  } else if (++mark_age == mark_span) {
+    mark = hsh;
+    mark_age = 0;
+    mark_span *= 2;
+  }
+}
+
+void Game::new_cookie() {
+  hsh ^= zobrist(cookie_key, cooky);
+  cooky = random_free_cell();
+  hsh ^= zobrist(cookie_key, cooky);
+}
 
 int Game::random_free_cell() const {
   std::uniform_int_distribution<int> dist(0, f.size().area() - s.size() - 1);
@@ -1,6 +1,7 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include <cstdint>
 #include <random>
 #include <vector>
 
@@ -37,32 +38,51 @@ class Snake {
   Snake(const Field &field);
   bool contains(int cell, bool test_tail) const;
   bool eats_itself() const;
-  int tail() const { return cs[sz - 1]; }
-  int head() const { return cs[0]; }
-  int cell(int i) const { return cs[i]; }
+  int tail() const { return cell(sz - 1); }
+  int head() const { return cell(0); }
+  int cell(int i) const { return wide ? cs32[i] : cs16[i]; }
   int size() const { return sz; }
   void move(Dir dir);
   void grow();
 
  private:
-  std::vector<int> cs;
+  void set_cell(int i, int cell);
+
+  // The cells from the head on, 16 bits wide on fields of up to 65536
+  // cells, which halves what a move shifts and a copy takes, 32 bits on
+  // bigger ones; only one of the two is used.
+  bool wide;
+  std::vector<uint16_t> cs16;
+  std::vector<int> cs32;
+  std::vector<uint8_t> occ;  // how many snake cells are on each field cell
   int sz;
-  const Field &f;
+  Field f;
 };
 
+// Copies are independent games that go on from the same state, the way a
+// search plays out moves ahead.
 class Game {
  public:
-  Game(Size field_size);
+  Game(Size field_size, unsigned seed = 2);
   void move(Dir dir, bool *cookie_eaten);
   bool is_over() const { return over; }
   const Field &field() const { return f; }
   const Snake &snake() const { return s; }
   int cookie() const { return cooky; }
   int score() const { return scr; }
+  // Places the cookies to come from a new seed.
+  void reseed(unsigned seed) { mt.seed(seed); }
+  // Zobrist hash of the snake, cell by cell in order, and the cookie.
+  uint64_t hash() const { return hsh; }
+  // Whether a state has come back since the last cookie was eaten. The
+  // cookie stays where it is until then, so an AI that decides by the
+  // state alone goes round the same loop for ever.
+  bool is_looping() const { return looping; }
 
  private:
   void new_cookie();
   int random_free_cell() const;
+  void check_loop();
 
   Field f;
   Snake s;
@@ -70,6 +90,14 @@ class Game {
   int scr;
   bool over;
   mutable std::mt19937 mt;
+  uint64_t hsh;
+  // Brent's cycle finding: the hash is compared with one kept from the
+  // last power of two moves, so a loop shows within twice its length
+  // after it starts.
+  uint64_t mark;
+  long mark_age;
+  long mark_span;
+  bool looping;
 };
 
 #endif  // GAME_H
\ No newline at end of file
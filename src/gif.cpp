@@ -1,8 +1,27 @@
 #include "gif.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GIF_POSIX
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "thread_pool.h"
 
 namespace gif {
 
@@ -11,6 +30,132 @@ uint8_t lo_byte(uint16_t word) { return word & 0xff; }
 
 // MARK: IO
 
+// Collects writes into big buffers and hands the full ones to a thread that
+// writes them out, so the encoder only waits for the disk when every buffer
+// is queued.
+class FileDevice::Writer {
+ public:
+  enum { buffer_size = 256 * 1024, buffer_count = 3 };
+
+  Writer(FILE *file) : f(file), failed(false), busy(false), stop(false) {
+    for (int i = 0; i < buffer_count; i++) {
+      spare.emplace_back();
+      spare.back().reserve(buffer_size);
+    }
+    take_spare();
+    thread = std::thread([this] { run(); });
+  }
+
+  ~Writer() { finish(); }
+
+  // Writes out everything queued so far and the stdio buffer behind it.
+  // The current buffer only goes back to the pool if it had anything in it.
+  bool flush() {
+    bool queued = queue_current();
+    {
+      std::unique_lock<std::mutex> lock(m);
+      spare_cv.wait(lock,
+                    [this] { return (full.empty() && !busy) || failed; });
+    }
+    bool ok = (!queued || take_spare()) && fflush(f) == 0;
+    return ok && !failed;
+  }
+
+  // Writes out the rest and stops the thread; false if any write failed.
+  bool finish() {
+    if (!thread.joinable()) {
+      return !failed;
+    }
+    queue_current();
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    full_cv.notify_one();
+    thread.join();
+    return !failed;
+  }
+
+  size_t write(const void *buf, size_t len) {
+    auto src = static_cast<const uint8_t *>(buf);
+    size_t left = len;
+    while (left > 0) {
+      size_t n = std::min(left, buffer_size - cur.size());
+      cur.insert(cur.end(), src, src + n);
+      src += n;
+      left -= n;
+      if (cur.size() == buffer_size) {
+        queue_current();
+        if (!take_spare()) {
+          return 0;
+        }
+      }
+    }
+    return len;
+  }
+
+ private:
+  // False if there was nothing to queue; cur is then kept.
+  bool queue_current() {
+    if (cur.empty()) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m);
+      full.push_back(std::move(cur));
+    }
+    full_cv.notify_one();
+    cur = std::vector<uint8_t>();
+    return true;
+  }
+
+  bool take_spare() {
+    std::unique_lock<std::mutex> lock(m);
+    spare_cv.wait(lock, [this] { return !spare.empty() || failed; });
+    if (failed) {
+      return false;
+    }
+    cur = std::move(spare.front());
+    spare.pop_front();
+    cur.clear();
+    return true;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(m);
+    for (;;) {
+      full_cv.wait(lock, [this] { return !full.empty() || stop; });
+      if (full.empty()) {
+        return;
+      }
+      std::vector<uint8_t> buf = std::move(full.front());
+      full.pop_front();
+      busy = true;
+      lock.unlock();
+      bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+      lock.lock();
+      busy = false;
+      failed = failed || !ok;
+      spare.push_back(std::move(buf));
+      spare_cv.notify_one();
+    }
+  }
+
+  FILE *f;
+  std::vector<uint8_t> cur;
+  std::deque<std::vector<uint8_t>> spare;
+  std::deque<std::vector<uint8_t>> full;
+  std::mutex m;
+  std::condition_variable full_cv;
+  std::condition_variable spare_cv;
+  bool failed;
+  bool busy;  // a buffer is being written
+  bool stop;
+  std::thread thread;
+};
+
+FileDevice::FileDevice(const std::string &name) : n(name), f(0) {}
+
 FileDevice::~FileDevice() { close(); }
 
 bool FileDevice::open(OpenMode mode) {
@@ -26,31 +171,100 @@ bool FileDevice::open(OpenMode mode) {
     m = mode;
     return true;
   }
-  if (mode == write_only) {
+  if (mode == write_only || mode == async_write) {
     f = fopen(n.c_str(), "wb");
     if (!f) {
       return false;
     }
+    if (mode == async_write) {
+      w = std::make_unique<Writer>(f);
+    }
     m = mode;
     return true;
   }
   return false;
 }
 
-void FileDevice::close() {
+bool FileDevice::close() {
   if (m == not_open) {
-    return;
+    return true;
   }
-  fclose(f);
+  bool ok = !w || w->finish();
+  w.reset();
+  ok = fclose(f) == 0 && ok;
   m = not_open;
+  return ok;
 }
 
 size_t FileDevice::write(const void *buf, size_t len) {
+  if (w) {
+    return w->write(buf, len);
+  }
   return fwrite(buf, 1, len, f);
 }
 
 size_t FileDevice::read(void *buf, size_t len) { return fread(buf, 1, len, f); }
 
+bool FileDevice::flush() {
+  if (w) {
+    return w->flush();
+  }
+  return fflush(f) == 0;
+}
+
+#ifdef GIF_POSIX
+size_t FdDevice::read(void *buf, size_t len) {
+  auto dst = static_cast<uint8_t *>(buf);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::read(fd, dst + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+size_t FdDevice::write(const void *buf, size_t len) {
+  auto src = static_cast<const uint8_t *>(buf);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::write(fd, src + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+#else
+size_t FdDevice::read(void *, size_t) { return 0; }
+size_t FdDevice::write(const void *, size_t) { return 0; }
+#endif
+
+bool FileDevice::skip(size_t len) {
+  return fseek(f, (long)len, SEEK_CUR) == 0;
+}
+
+bool IODevice::skip(size_t len) {
+  uint8_t buf[4096];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    if (read(buf, n) != n) {
+      return false;
+    }
+    len -= n;
+  }
+  return true;
+}
+
 size_t MemDevice::write(const void *buf, size_t len) {
   size_t bytesLeft = l - p;
   if (len > bytesLeft) len = bytesLeft;
@@ -67,6 +281,15 @@ size_t MemDevice::read(void *buf, size_t len) {
   return len;
 }
 
+const uint8_t *MemDevice::view(size_t len) {
+  if (len > l - p) {
+    return nullptr;
+  }
+  const uint8_t *res = d + p;
+  p += len;
+  return res;
+}
+
 int MemDevice::open_for_read(const uint8_t *src, size_t len) {
   init((uint8_t *)src, len);
   m = read_only;
@@ -78,39 +301,234 @@ void MemDevice::open_for_write(uint8_t *dst, size_t maxLen) {
   m = write_only;
 }
 
-class HashTable {
+void BufferDevice::open(uint8_t *arena, size_t arena_len) {
+  own.clear();
+  d = arena;
+  l = 0;
+  cap = arena ? arena_len : 0;
+  m = write_only;
+}
+
+size_t BufferDevice::read(void *, size_t) { return 0; }
+
+size_t BufferDevice::write(const void *buf, size_t len) {
+  auto src = static_cast<const uint8_t *>(buf);
+  if (in_arena()) {
+    if (len <= cap - l) {
+      memcpy(d + l, src, len);
+      l += len;
+      return len;
+    }
+    own.reserve(std::max(2 * cap, l + len));
+    own.assign(d, d + l);
+  }
+  own.insert(own.end(), src, src + len);  // grows geometrically
+  d = own.data();
+  l = own.size();
+  return len;
+}
+
+std::vector<uint8_t> BufferDevice::take() {
+  std::vector<uint8_t> res;
+  if (in_arena()) {
+    res.assign(d, d + l);
+  } else {
+    res = std::move(own);
+  }
+  own.clear();
+  d = nullptr;
+  l = cap = 0;
+  return res;
+}
+
+MmapDevice::~MmapDevice() { close(); }
+
+bool MmapDevice::open() {
+  if (m != not_open) {
+    return false;
+  }
+#ifdef GIF_POSIX
+  int fd = ::open(n.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  l = st.st_size;
+  if (l > 0) {
+    void *addr = mmap(nullptr, l, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      madvise(addr, l, MADV_SEQUENTIAL);
+      d = static_cast<const uint8_t *>(addr);
+      mapped = true;
+    }
+  }
+  ::close(fd);
+  if (mapped || l == 0) {
+    p = 0;
+    m = read_only;
+    return true;
+  }
+#endif
+  FILE *f = fopen(n.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  uint8_t buf[64 * 1024];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    copy.insert(copy.end(), buf, buf + len);
+  }
+  fclose(f);
+  d = copy.data();
+  l = copy.size();
+  p = 0;
+  m = read_only;
+  return true;
+}
+
+bool MmapDevice::close() {
+  if (m == not_open) {
+    return true;
+  }
+#ifdef GIF_POSIX
+  if (mapped) {
+    munmap(const_cast<uint8_t *>(d), l);
+  }
+#endif
+  copy.clear();
+  d = nullptr;
+  l = p = 0;
+  mapped = false;
+  m = not_open;
+  return true;
+}
+
+size_t MmapDevice::read(void *buf, size_t len) {
+  size_t left = l - p;
+  if (len > left) len = left;
+  memcpy(buf, d + p, len);
+  p += len;
+  return len;
+}
+
+size_t MmapDevice::write(const void *, size_t) { return 0; }
+
+const uint8_t *MmapDevice::view(size_t len) {
+  if (len > l - p) {
+    return nullptr;
+  }
+  const uint8_t *res = d + p;
+  p += len;
+  return res;
+}
+
+// The LZW string table: open addressing over 8192 slots, where every slot
+// carries the generation it was filled in, so clear() just starts a new
+// generation and the table is only wiped when the 8-bit generation counter
+// wraps. A multiplicative hash spreads the 20-bit keys of neighboring
+// codes.
+class StampedHashTable {
  public:
-  HashTable() { clear(); }
-  void clear() { memset(table, 0xFF, sizeof(table)); }
+  StampedHashTable() : gen(0) { clear(); }
+  void clear() {
+    if (++gen == 0) {
+      memset(stamp, 0, sizeof(stamp));
+      gen = 1;
+    }
+  }
 
   void insert(uint32_t key, int code) {
     size_t n_key = norm_key(key);
-    while (get_key(table[n_key]) != 0xFFFFFL) {
+    while (stamp[n_key] == gen) {
       n_key = (n_key + 1) & key_mask;
     }
-    table[n_key] = put_key(key) | put_code(code);
+    stamp[n_key] = gen;
+    table[n_key] = (key << 12) | code;
   }
 
   int get(uint32_t key) {
     size_t n_key = norm_key(key);
-    uint32_t htKey;
-    while ((htKey = get_key(table[n_key])) != 0xFFFFFL) {
-      if (key == htKey) return get_code(table[n_key]);
+    while (stamp[n_key] == gen) {
+      if ((table[n_key] >> 12) == key) return table[n_key] & 0x0FFF;
       n_key = (n_key + 1) & key_mask;
     }
     return -1;
   }
 
  private:
-  static uint32_t get_key(uint32_t l) { return l >> 12; }
-  static uint32_t get_code(uint32_t l) { return l & 0x0FFF; }
-  static uint32_t put_key(uint32_t l) { return l << 12; }
-  static uint32_t put_code(uint32_t l) { return l & 0x0FFF; }
   static const uint32_t key_mask = 0x1FFF;
-  size_t norm_key(uint32_t key) { return ((key >> 12) ^ key) & key_mask; }
+  static size_t norm_key(uint32_t key) {
+    return ((key * 0x9E3779B1u) >> 19) & key_mask;
+  }
   uint32_t table[8192];
+  uint8_t stamp[8192] = {};
+  uint8_t gen;
+};
+
+// The string table plus, for every pixel value p, the codes of the strings
+// p^2, p^3, ... made of p alone, so LZEncoder can step through long runs of
+// one color without looking up every pixel.
+struct LZDict {
+  StampedHashTable table;
+  std::vector<uint16_t> runs[256];
+
+  void clear() {
+    table.clear();
+    for (auto &r : runs) {
+      r.clear();
+    }
+  }
 };
 
+// Encoders reuse one dictionary per thread instead of setting up a fresh
+// one for every image.
+LZDict &lz_dict() {
+  thread_local LZDict dict;
+  return dict;
+}
+
+// All the bits set in any of the len bytes, eight bytes at a time.
+uint8_t or_bits(const uint8_t *data, size_t len) {
+  uint64_t acc = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    acc |= w;
+  }
+  acc |= acc >> 32;
+  acc |= acc >> 16;
+  acc |= acc >> 8;
+  uint8_t res = acc & 0xff;
+  for (; i < len; ++i) {
+    res |= data[i];
+  }
+  return res;
+}
+
+// Number of leading bytes of line equal to pixel.
+size_t run_length(const uint8_t *line, size_t len, uint8_t pixel) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i p = _mm_set1_epi8(pixel);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+    unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) ^ 0xffff;
+    if (diff) {
+      return i + __builtin_ctz(diff);
+    }
+  }
+#endif
+  while (i < len && line[i] == pixel) {
+    i++;
+  }
+  return i;
+}
+
 struct LZ {
   enum CodecConsts {
     bits = 12,
@@ -134,25 +552,53 @@ class LZEncoder {
         crnt_code(LZ::first_code),
         crnt_shift_state(0),
         crnt_shift_dword(0),
-        pix_count(pixel_count) {
-    buf[0] = 0;
+        pix_count(pixel_count),
+        block(nullptr),
+        block_len(0),
+        run_pixel(0),
+        run_len(0),
+        dict(lz_dict()) {
+    dict.clear();
     encode(clear_code);
   }
 
-  int put_line(uint8_t *line, int len) {
-    if (pix_count < (unsigned)len) {
+  // Encodes rows of width pixels, stride bytes apart; the pixels are left
+  // untouched. Out of range color indices are masked in a scratch row, but
+  // only when the rows turn out to have any.
+  int put_rows(const uint8_t *first, unsigned width, unsigned rows,
+               size_t stride) {
+    size_t count = (size_t)width * rows;
+    if (pix_count < count) {
       f.set_error(ErrorCode::data_too_big);
       return 0;
     }
-    pix_count -= len;
 
     static const uint8_t code_mask[] = {0x00, 0x01, 0x03, 0x07, 0x0f,
                                         0x1f, 0x3f, 0x7f, 0xff};
     uint8_t mask = code_mask[col_res];
-    for (int i = 0; i < len; i++) {
-      line[i] &= mask;
+    uint8_t used_bits = 0;
+    for (unsigned y = 0; y < rows; ++y) {
+      used_bits |= or_bits(first + y * stride, width);
     }
-    return encode_line(line, len);
+
+    std::vector<uint8_t> masked;
+    if (used_bits & ~mask) {
+      masked.resize(width);
+    }
+    for (unsigned y = 0; y < rows; ++y) {
+      const uint8_t *row = first + y * stride;
+      if (!masked.empty()) {
+        for (unsigned x = 0; x < width; ++x) {
+          masked[x] = row[x] & mask;
+        }
+        row = &masked[0];
+      }
+      pix_count -= width;
+      if (!encode_line(row, width)) {
+        return 0;
+      }
+    }
+    return 1;
   }
 
  private:
@@ -187,34 +633,91 @@ class LZEncoder {
     return res;
   }
 
-  int encode_line(uint8_t *line, int len) {
+  // Emits the current string and adds it extended by pixel to the
+  // dictionary, or starts over with a clear code when the dictionary is full.
+  bool emit(int code, uint8_t pixel) {
+    if (!encode(code)) {
+      f.set_error(ErrorCode::write_failed);
+      return false;
+    }
+    if (run_code >= LZ::max_code) {
+      if (!encode(clear_code)) {
+        f.set_error(ErrorCode::write_failed);
+        return false;
+      }
+      run_code = eof_code + 1;
+      run_bits = col_res + 1;
+      max_code = 1 << run_bits;
+      dict.clear();
+    } else {
+      if (run_len > 0 && pixel == run_pixel) {
+        dict.runs[pixel].push_back(run_code);
+      }
+      dict.table.insert((((uint32_t)code) << 8) + pixel, run_code++);
+    }
+    return true;
+  }
+
+  // Feeds count more pixels equal to run_pixel while the current string is
+  // a run of them. Produces the same codes as the pixel by pixel loop, but
+  // jumps straight to the longest known run instead of looking up every
+  // pixel.
+  bool encode_run(int *code, size_t count) {
+    auto &chain = dict.runs[run_pixel];
+    while (count > 0) {
+      size_t known = chain.size() + 1;
+      if (run_len + count <= known) {
+        run_len += count;
+        break;
+      }
+      count -= known - run_len + 1;
+      run_len = known;
+      int longest = known == 1 ? run_pixel : chain[known - 2];
+      if (!emit(longest, run_pixel)) {
+        return false;
+      }
+      run_len = 1;
+    }
+    *code = run_len == 1 ? run_pixel : chain[run_len - 2];
+    return true;
+  }
+
+  int encode_line(const uint8_t *line, int len) {
+    enum { min_run = 4 };
     int i = 0;
-    int code = (crnt_code == LZ::LZ::first_code) ? line[i++] : crnt_code;
+    int code = crnt_code;
+    if (code == LZ::first_code) {
+      code = run_pixel = line[i++];
+      run_len = 1;
+    }
     while (i < len) {
-      uint8_t pixel = line[i++];
-      unsigned long new_key = (((uint32_t)code) << 8) + pixel;
-      int new_code;
+      uint8_t pixel = line[i];
+      // Builds with GIF_LZW_NO_RUNS go pixel by pixel throughout, for the
+      // benchmark to compare.
+#ifndef GIF_LZW_NO_RUNS
+      if (run_len > 0 && pixel == run_pixel) {
+        size_t run = run_length(line + i, len - i, pixel);
+        if (run >= min_run) {
+          if (!encode_run(&code, run)) {
+            return 0;
+          }
+          i += run;
+          continue;
+        }
+      }
+#endif
+      i++;
 
-      if ((new_code = ht.get(new_key)) >= 0) {
+      int new_code = dict.table.get((((uint32_t)code) << 8) + pixel);
+      if (new_code >= 0) {
         code = new_code;
+        run_len = (run_len > 0 && pixel == run_pixel) ? run_len + 1 : 0;
       } else {
-        if (!encode(code)) {
-          f.set_error(ErrorCode::write_failed);
+        if (!emit(code, pixel)) {
           return 0;
         }
-        code = pixel;
-        if (run_code >= LZ::max_code) {
-          if (!encode(clear_code)) {
-            f.set_error(ErrorCode::write_failed);
-            return 0;
-          }
-          run_code = eof_code + 1;
-          run_bits = col_res + 1;
-          max_code = 1 << run_bits;
-          ht.clear();
-        } else {
-          ht.insert(new_key, run_code++);
-        }
+        code = run_pixel = pixel;
+        run_len = 1;
       }
     }
     crnt_code = code;
@@ -227,26 +730,32 @@ class LZEncoder {
     return 1;
   }
 
+  // Sub-blocks are assembled right in the output buffer of GifIO: the
+  // length byte is filled in when the block is complete.
   int write_buf(int c) {
     if (c == LZ::flush_output) {
-      if (buf[0] != 0 && !f.write(buf, buf[0] + 1)) {
+      if (block_len != 0) {
+        block[0] = block_len;
+        f.commit(block_len + 1);
+        block_len = 0;
+      }
+      block = nullptr;
+      if (!f.write((uint8_t)0)) {
         f.set_error(ErrorCode::write_failed);
         return 0;
       }
-      buf[0] = 0;
-      if (!f.write(buf, 1)) {
+    } else {
+      if (!block && !(block = f.reserve(256))) {
         f.set_error(ErrorCode::write_failed);
         return 0;
       }
-    } else {
-      if (buf[0] == 255) {
-        if (!f.write(buf, buf[0] + 1)) {
-          f.set_error(ErrorCode::write_failed);
-          return 0;
-        }
-        buf[0] = 0;
+      block[++block_len] = c;
+      if (block_len == 255) {
+        block[0] = block_len;
+        f.commit(block_len + 1);
+        block = nullptr;
+        block_len = 0;
       }
-      buf[++buf[0]] = c;
     }
     return 1;
   }
@@ -263,215 +772,185 @@ class LZEncoder {
   int crnt_shift_state;
   unsigned long crnt_shift_dword;
   size_t pix_count;
-  uint8_t buf[256];
-  HashTable ht;
+  uint8_t *block;
+  int block_len;
+  uint8_t run_pixel;  // the current string is run_pixel^run_len,
+  int run_len;        // or run_len is 0
+  LZDict &dict;
 };
 
+// Every string in the dictionary has already appeared in the output: it is
+// the previous string plus one pixel, written right where the previous
+// string started. So a code is expanded by copying length[code] pixels from
+// offset[code] instead of walking its prefix chain. Codes are read from a
+// 64-bit bit buffer refilled from whole sub-blocks, which are read in place
+// when the device holds its data in memory.
 class LZDecoder {
  public:
-  LZDecoder(GifIO &file, size_t pixel_count, int color_res)
+  LZDecoder(GifIO &file, int color_res)
       : f(file),
         col_res(color_res),
         clear_code(1 << color_res),
         eof_code(clear_code + 1),
-        run_code(eof_code + 1),
-        run_bits(color_res + 1),
-        max_code(1 << run_bits),
-        last_code(LZ::no_such_code),
-        crnt_shift_state(0),
-        crnt_shift_dword(0),
-        pix_count(pixel_count),
-        stack_ptr(0) {
-    buf[0] = 0;
-    clear_prefix();
-  }
-
-  void clear_prefix() {
-    for (int i = 0; i <= LZ::max_code; i++) {
-      prefix[i] = LZ::no_such_code;
-    }
+        prev_start(0),
+        bit_buf(0),
+        bit_count(0),
+        block_pos(0),
+        block_len(0),
+        eof_seen(false),
+        block(nullptr) {
+    reset();
   }
 
-  int getLine(uint8_t *line, int lineLen) {
-    uint8_t *dummy;
+  // Decodes exactly len pixels into out and skips whatever is left of the
+  // image data up to its block terminator.
+  bool decode(uint8_t *out, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+      int code;
+      if (!read_code(&code)) {
+        return false;
+      }
+      if (code == clear_code) {
+        reset();
+        continue;
+      }
+      if (code == eof_code) {
+        f.set_error(ErrorCode::eof_too_soon);
+        return false;
+      }
 
-    if ((pix_count -= lineLen) > 0xffff0000UL) {
-      f.set_error(ErrorCode::data_too_big);
-      return 0;
-    }
+      size_t start = pos;
+      if (code < clear_code) {
+        out[pos++] = code;
+      } else if (code < free_code) {
+        pos += copy(out, start, offset[code], length[code], len);
+      } else if (code == free_code && prev_code != LZ::no_such_code) {
+        // The string being defined: the previous one plus its own first
+        // pixel.
+        pos += copy(out, start, prev_start, length_of(prev_code), len);
+        if (pos < len) {
+          out[pos++] = first_of(prev_code);
+        }
+      } else {
+        f.set_error(ErrorCode::image_defect);
+        return false;
+      }
 
-    if (!decode_line(line, lineLen)) return 0;
-    if (pix_count == 0) {
-      do {
-        if (!next_code(&dummy)) return 0;
-      } while (dummy != NULL);
+      if (prev_code != LZ::no_such_code && free_code <= LZ::max_code) {
+        offset[free_code] = prev_start;
+        length[free_code] = length_of(prev_code) + 1;
+        first[free_code] = first_of(prev_code);
+        if (++free_code == 1 << code_bits && code_bits < LZ::bits) {
+          code_bits++;
+        }
+      }
+      prev_code = code;
+      prev_start = start;
     }
-    return 1;
+    return skip_rest();
   }
 
  private:
-  bool decode(int *code) {
-    static const unsigned short code_masks[] = {
-        0x0000, 0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f,
-        0x007f, 0x00ff, 0x01ff, 0x03ff, 0x07ff, 0x0fff};
-
-    if (run_bits > LZ::bits) {
-      f.set_error(ErrorCode::image_defect);
-      return false;
-    }
-
-    while (crnt_shift_state < run_bits) {
-      uint8_t next_byte;
-      if (!read_buf(&next_byte)) {
-        return false;
-      }
-      crnt_shift_dword |= ((unsigned long)next_byte) << crnt_shift_state;
-      crnt_shift_state += 8;
-    }
-    *code = crnt_shift_dword & code_masks[run_bits];
-    crnt_shift_dword >>= run_bits;
-    crnt_shift_state -= run_bits;
+  void reset() {
+    free_code = eof_code + 1;
+    code_bits = col_res + 1;
+    prev_code = LZ::no_such_code;
+  }
 
-    if (run_code < LZ::max_code + 2 && ++run_code > max_code &&
-        run_bits < LZ::bits) {
-      max_code <<= 1;
-      run_bits++;
-    }
-    return true;
+  unsigned length_of(int code) const {
+    return code < clear_code ? 1 : length[code];
   }
 
-  int prefix_char(unsigned int *prefix, int code, int clear_code) {
-    int i = 0;
-    while (code > clear_code && i++ <= LZ::max_code) {
-      if (code > LZ::max_code) {
-        return LZ::no_such_code;
-      }
-      code = prefix[code];
-    }
-    return code;
+  uint8_t first_of(int code) const {
+    return code < clear_code ? code : first[code];
   }
 
-  bool decode_line(uint8_t *line, int line_len) {
-    if (stack_ptr > LZ::max_code) {
-      return false;
+  // Copies a string that starts at out[from] to out[to], cut at the end of
+  // the image. The source always ends before the destination starts, so
+  // with enough room behind the destination whole words are copied and the
+  // bytes past the string are overwritten by the following strings.
+  static size_t copy(uint8_t *out, size_t to, size_t from, size_t n,
+                     size_t len) {
+    if (n > len - to) {
+      n = len - to;
     }
-
-    int i = 0;
-    while (stack_ptr && i < line_len) {
-      line[i++] = stack[--stack_ptr];
+    uint8_t *dst = out + to;
+    const uint8_t *src = out + from;
+    if (to - from >= 8 && len - to >= n + 8) {
+      for (size_t i = 0; i < n; i += 8) {
+        memcpy(dst + i, src + i, 8);
+      }
+    } else {
+      memcpy(dst, src, n);
     }
+    return n;
+  }
 
-    while (i < line_len) {
-      int crnt_code;
-      if (!decode(&crnt_code)) {
+  bool read_code(int *code) {
+    if (bit_count < code_bits) {
+      if (!refill()) {
         return false;
       }
+    }
+    *code = bit_buf & ((1u << code_bits) - 1);
+    bit_buf >>= code_bits;
+    bit_count -= code_bits;
+    return true;
+  }
 
-      if (crnt_code == eof_code) {
-        f.set_error(ErrorCode::eof_too_soon);
+  bool refill() {
+    while (bit_count < code_bits) {
+      if (block_pos == block_len && !read_block()) {
         return false;
-      } else if (crnt_code == clear_code) {
-        clear_prefix();
-        run_code = eof_code + 1;
-        run_bits = col_res + 1;
-        max_code = 1 << run_bits;
-        last_code = last_code = LZ::no_such_code;
-      } else {
-        if (crnt_code < clear_code) {
-          line[i++] = crnt_code;
-        } else {
-          int crnt_prefix;
-          if (prefix[crnt_code] == LZ::no_such_code) {
-            if (crnt_code == run_code - 2) {
-              crnt_prefix = last_code;
-              suffix[run_code - 2] = stack[stack_ptr++] =
-                  prefix_char(prefix, last_code, clear_code);
-            } else {
-              f.set_error(ErrorCode::image_defect);
-              return false;
-            }
-          } else {
-            crnt_prefix = crnt_code;
-          }
-
-          while (stack_ptr < LZ::max_code && crnt_prefix > clear_code &&
-                 crnt_prefix <= LZ::max_code) {
-            stack[stack_ptr++] = suffix[crnt_prefix];
-            crnt_prefix = prefix[crnt_prefix];
-          }
-          if (stack_ptr >= LZ::max_code || crnt_prefix > LZ::max_code) {
-            f.set_error(ErrorCode::image_defect);
-            return false;
-          }
-          stack[stack_ptr++] = crnt_prefix;
-
-          while (stack_ptr != 0 && i < line_len) {
-            line[i++] = stack[--stack_ptr];
-          }
-        }
-        if ((last_code != LZ::no_such_code) &&
-            (prefix[run_code - 2] == LZ::no_such_code)) {
-          prefix[run_code - 2] = last_code;
-
-          if (crnt_code == run_code - 2) {
-            suffix[run_code - 2] = prefix_char(prefix, last_code, clear_code);
-          } else {
-            suffix[run_code - 2] = prefix_char(prefix, crnt_code, clear_code);
-          }
-        }
-        last_code = crnt_code;
+      }
+      while (bit_count <= 56 && block_pos < block_len) {
+        bit_buf |= (uint64_t)block[block_pos++] << bit_count;
+        bit_count += 8;
       }
     }
     return true;
   }
 
-  bool next_code(uint8_t **code_block) {
+  bool read_block() {
     uint8_t len;
     if (!f.read(&len)) {
       f.set_error(ErrorCode::read_failed);
       return false;
     }
-    if (len > 0) {
-      *code_block = buf;
-      (*code_block)[0] = len;
-      if (!f.read(&((*code_block)[1]), len)) {
-        f.set_error(ErrorCode::read_failed);
-        return false;
-      }
-    } else {
-      *code_block = 0;
-      buf[0] = 0;
-      pix_count = 0;
+    if (len == 0) {
+      eof_seen = true;
+      f.set_error(ErrorCode::image_defect);
+      return false;
+    }
+    block = f.view(len);
+    if (!block) {
+      f.set_error(ErrorCode::read_failed);
+      return false;
     }
+    block_pos = 0;
+    block_len = len;
     return true;
   }
 
-  bool read_buf(uint8_t *nextByte) {
-    if (buf[0] == 0) {
-      if (!f.read(buf, 1)) {
+  bool skip_rest() {
+    if (eof_seen) {
+      return true;
+    }
+    for (;;) {
+      uint8_t len;
+      if (!f.read(&len)) {
         f.set_error(ErrorCode::read_failed);
         return false;
       }
-      if (buf[0] == 0) {
-        f.set_error(ErrorCode::image_defect);
-        return false;
-      }
-      if (buf[0] == 0) {
-        f.set_error(ErrorCode::image_defect);
-        return false;
+      if (len == 0) {
+        return true;
       }
-      if (!f.read(&buf[1], buf[0])) {
+      if (!f.skip(len)) {
         f.set_error(ErrorCode::read_failed);
         return false;
       }
-      *nextByte = buf[1];
-      buf[1] = 2;
-      buf[0]--;
-    } else {
-      *nextByte = buf[buf[1]++];
-      buf[0]--;
     }
-    return true;
   }
 
  private:
@@ -479,18 +958,19 @@ class LZDecoder {
   int col_res;
   const int clear_code;
   const int eof_code;
-  int run_code;
-  int run_bits;
-  int max_code;
-  int last_code;
-  int crnt_shift_state;
-  unsigned long crnt_shift_dword;
-  size_t pix_count;
-  int stack_ptr;
-  uint8_t stack[LZ::max_code];
-  uint8_t buf[256];
-  uint8_t suffix[LZ::max_code + 1];
-  unsigned int prefix[LZ::max_code + 1];
+  int free_code;
+  int code_bits;
+  int prev_code;
+  size_t prev_start;
+  uint64_t bit_buf;
+  int bit_count;
+  int block_pos;
+  int block_len;
+  bool eof_seen;
+  const uint8_t *block;
+  uint8_t first[LZ::max_code + 1];
+  uint16_t length[LZ::max_code + 1];
+  size_t offset[LZ::max_code + 1];
 };
 
 // MARK: GifIO
@@ -510,14 +990,23 @@ bool GifIO::probe() {
 }
 
 bool GifIO::write_terminator() {
-  uint8_t buf = Gif::terminator;
-  return d.write(&buf, 1) == 1;
+  return write((uint8_t)Gif::terminator) && flush();
 }
 
 bool GifIO::read(uint8_t *buf, size_t len) { return d.read(buf, len) == len; }
 
 bool GifIO::read(uint8_t *byte) { return d.read(byte, 1) == 1; }
 
+const uint8_t *GifIO::view(size_t len) {
+  if (const uint8_t *res = d.view(len)) {
+    return res;
+  }
+  if (in.size() < len) {
+    in.resize(len);
+  }
+  return d.read(in.data(), len) == len ? in.data() : nullptr;
+}
+
 bool GifIO::read(uint16_t *word) {
   uint8_t buf[2];
   if (d.read(buf, 2) != 2) {
@@ -594,17 +1083,60 @@ bool GifIO::read(GifRecordType *type) {
   return true;
 }
 
+bool GifIO::flush() {
+  if (out_len == 0) {
+    return true;
+  }
+  bool ok = d.write(&out[0], out_len) == out_len;
+  out_len = 0;
+  if (!ok) {
+    set_error(ErrorCode::write_failed);
+  }
+  return ok;
+}
+
+uint8_t *GifIO::reserve(size_t len) {
+  if (out.empty()) {
+    out.resize(out_cap);
+  }
+  if (out_len + len > out.size() && !flush()) {
+    return nullptr;
+  }
+  return &out[out_len];
+}
+
 bool GifIO::write(const uint8_t *buf, size_t len) {
-  return d.write(buf, len) == len;
+  if (len >= out_cap) {
+    return flush() && d.write(buf, len) == len;
+  }
+  uint8_t *dst = reserve(len);
+  if (!dst) {
+    return false;
+  }
+  memcpy(dst, buf, len);
+  commit(len);
+  return true;
 }
 
-bool GifIO::write(uint8_t byte) { return d.write(&byte, 1) == 1; }
+bool GifIO::write(uint8_t byte) {
+  uint8_t *dst = reserve(1);
+  if (!dst) {
+    return false;
+  }
+  dst[0] = byte;
+  commit(1);
+  return true;
+}
 
 bool GifIO::write(uint16_t word) {
-  uint8_t buf[2];
-  buf[0] = word & 0xff;
-  buf[1] = (word >> 8) & 0xff;
-  return d.write(buf, 2) == 2;
+  uint8_t *dst = reserve(2);
+  if (!dst) {
+    return false;
+  }
+  dst[0] = word & 0xff;
+  dst[1] = (word >> 8) & 0xff;
+  commit(2);
+  return true;
 }
 
 bool GifIO::write(RGB rgb) {
@@ -637,11 +1169,27 @@ Extension create_animation_mark(uint16_t replays) {
 
 Extension create_delay_mark(uint16_t delay) {
   Extension res(Extension::graphics);
-  delay += 2;
+  delay += delay_padding;
   res.append({4, lo_byte(delay), hi_byte(delay), 0});
   return res;
 }
 
+int Extension::transparent_color() const {
+  enum { transparent_flag = 0x01 };
+  if (fn == graphics && !list.empty() && list[0].size() >= 4 &&
+      (list[0][0] & transparent_flag)) {
+    return list[0][3];
+  }
+  return -1;
+}
+
+void Extension::remap_colors(const uint8_t *remap) {
+  int color = transparent_color();
+  if (color >= 0) {
+    list[0][3] = remap[color];
+  }
+}
+
 void Extension::append(const std::vector<uint8_t> &data) {
   list.push_back(data);
 }
@@ -659,15 +1207,16 @@ bool Extension::load_chunk(GifIO &io, ExtensionChunk *chunk, bool *last) {
     return true;
   }
 
-  chunk->resize(size);
-  if (!io.read(&((*chunk)[0]), size)) {
+  const uint8_t *data = io.view(size);
+  if (!data) {
     io.set_error(ErrorCode::read_failed);
     return false;
   }
+  chunk->assign(data, data + size);
   return true;
 }
 
-bool Extension::save_chunk(GifIO &io, const ExtensionChunk &chunk) {
+bool Extension::save_chunk(GifIO &io, const ExtensionChunk &chunk) const {
   uint8_t sz = chunk.size();
   return io.write(sz) && io.write(&chunk[0], chunk.size());
 }
@@ -694,23 +1243,23 @@ bool Extension::load(GifIO &io) {
   return true;
 }
 
-bool Extension::save_leader(GifIO &io) {
+bool Extension::save_leader(GifIO &io) const {
   uint8_t buf[2];
   buf[0] = Gif::extension;
   buf[1] = fn;
   return io.write(buf, 2);
 }
 
-bool Extension::save_trailer(GifIO &io) {
+bool Extension::save_trailer(GifIO &io) const {
   uint8_t trailer = 0;
   return io.write(trailer);
 }
 
-bool Extension::save(GifIO &io) {
+bool Extension::save(GifIO &io) const {
   if (!save_leader(io)) {
     return false;
   }
-  for (auto c : list) {
+  for (auto &c : list) {
     if (!save_chunk(io, c)) {
       return false;
     }
@@ -723,18 +1272,20 @@ bool Extension::save(GifIO &io) {
 
 bool ColorMap::load(GifIO &io) {
   size_t color_count = 1 << r;
-  for (size_t i = 0; i < color_count; ++i) {
-    c.emplace_back();
-    if (!io.read(&c.back())) {
-      return false;
-    }
+  const uint8_t *data = io.view(color_count * 3);
+  if (!data) {
+    return false;
+  }
+  c.reserve(color_count);
+  for (size_t i = 0; i < color_count; ++i, data += 3) {
+    c.emplace_back(data[0], data[1], data[2]);
   }
   return true;
 }
 
-bool ColorMap::save(GifIO &io) {
+bool ColorMap::save(GifIO &io) const {
   size_t color_count = 1 << r;
-  for (auto i : c) {
+  for (auto &i : c) {
     if (!io.write(i)) {
       io.set_error(ErrorCode::write_failed);
       return false;
@@ -743,7 +1294,8 @@ bool ColorMap::save(GifIO &io) {
   return true;
 }
 
-bool Gif::save_scr_desc(GifIO &io) {
+static bool write_scr_desc(GifIO &io, const Size &sz, uint8_t bg,
+                           const std::optional<ColorMap> &cm) {
   const char *ver = "GIF89a";
   if (!io.write((uint8_t *)ver, strlen(ver))) {
     io.set_error(ErrorCode::write_failed);
@@ -765,6 +1317,8 @@ bool Gif::save_scr_desc(GifIO &io) {
   return true;
 }
 
+bool Gif::save_scr_desc(GifIO &io) { return write_scr_desc(io, sz, bg, cm); }
+
 bool get_color_res(std::optional<ColorMap> local_cm,
                    std::optional<ColorMap> global_cm, uint8_t *color_res) {
   if (!local_cm && !global_cm) {
@@ -778,12 +1332,13 @@ bool get_color_res(std::optional<ColorMap> local_cm,
   return true;
 }
 
-bool Image::save(GifIO &io, std::optional<ColorMap> global_colormap) {
+bool Image::save(GifIO &io,
+                 const std::optional<ColorMap> &global_colormap) const {
   if (rect.area() == 0) {
     return true;
   }
 
-  for (auto ext : exts) {
+  for (auto &ext : exts) {
     if (!ext.save(io)) {
       io.set_error(ErrorCode::write_failed);
       return false;
@@ -807,22 +1362,55 @@ bool Image::save(GifIO &io, std::optional<ColorMap> global_colormap) {
   unsigned width = rect.width();
 
   if (interlace) {
-    int offset[] = {0, 4, 2, 1};
-    int jumps[] = {8, 8, 4, 2};
-    for (int i = 0; i < 4; i++)
-      for (int j = offset[i]; j < height; j += jumps[i]) {
-        if (!encoder.put_line(&b[j * width], width)) {
-          return false;
-        }
+    unsigned offset[] = {0, 4, 2, 1};
+    unsigned jumps[] = {8, 8, 4, 2};
+    for (int i = 0; i < 4; i++) {
+      if (offset[i] >= height) {
+        continue;
       }
-  } else {
-    for (int i = 0; i < height; i++) {
-      if (!encoder.put_line(&b[i * width], width)) {
+      unsigned rows = (height - offset[i] + jumps[i] - 1) / jumps[i];
+      if (!encoder.put_rows(&b[offset[i] * width], width, rows,
+                            (size_t)jumps[i] * width)) {
         return false;
       }
     }
+    return true;
   }
-  return true;
+  return encoder.put_rows(&b[0], width, height, width);
+}
+
+// Fast non-cryptographic hash of the size and the pixels, for spotting
+// repeated frames.
+uint64_t Image::hash() const {
+  const uint64_t k = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = (((uint64_t)rect.width() << 16) | rect.height()) * k;
+  const uint8_t *p = b.data();
+  size_t n = b.size();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * k;
+    h ^= h >> 29;
+  }
+  uint64_t w = 0;
+  memcpy(&w, p + i, n - i);
+  h = (h ^ w) * k;
+  return h ^ (h >> 32);
+}
+
+void Image::remap_colors(const uint8_t *remap) {
+  for (auto &pixel : b) {
+    pixel = remap[pixel];
+  }
+  for (auto &ext : exts) {
+    ext.remap_colors(remap);
+  }
+}
+
+bool Image::same_bits(const Image &other) const {
+  return rect.width() == other.rect.width() &&
+         rect.height() == other.rect.height() && b == other.b;
 }
 
 bool Image::load(GifIO &io) {
@@ -830,36 +1418,67 @@ bool Image::load(GifIO &io) {
     return false;
   }
 
+  b.resize(rect.area());
+  return load_bits(io, b.data());
+}
+
+bool Image::load_bits(GifIO &io, uint8_t *dst) const {
   uint8_t code_size;
   if (!io.read(&code_size)) {
     io.set_error(ErrorCode::read_failed);
     return false;
   }
-
-  LZDecoder decoder(io, rect.area(), code_size);
-  b.resize(rect.area());
+  if (code_size < 1 || code_size >= LZ::bits) {
+    io.set_error(ErrorCode::image_defect);
+    return false;
+  }
+  LZDecoder decoder(io, code_size);
 
   if (interlace) {
+    // The rows come in four passes; decode them in stream order first.
+    std::vector<uint8_t> rows(rect.area());
+    if (!decoder.decode(rows.data(), rows.size())) {
+      return false;
+    }
     int offset[] = {0, 4, 2, 1};
     int jumps[] = {8, 8, 4, 2};
-    int w = rect.width();
+    size_t w = rect.width();
     int h = rect.height();
+    const uint8_t *src = rows.data();
     for (int i = 0; i < 4; i++) {
       for (int j = offset[i]; j < h; j += jumps[i]) {
-        if (!decoder.getLine(&b[j * w], w)) {
-          return false;
-        }
+        memcpy(dst + j * w, src, w);
+        src += w;
       }
     }
-  } else {
-    if (!decoder.getLine(&b[0], b.size())) {
+    return true;
+  }
+  return decoder.decode(dst, rect.area());
+}
+
+bool Image::skip_bits(GifIO &io) {
+  uint8_t code_size;
+  if (!io.read(&code_size)) {
+    io.set_error(ErrorCode::read_failed);
+    return false;
+  }
+  for (;;) {
+    uint8_t len;
+    if (!io.read(&len)) {
+      io.set_error(ErrorCode::read_failed);
+      return false;
+    }
+    if (len == 0) {
+      return true;
+    }
+    if (!io.skip(len)) {
+      io.set_error(ErrorCode::read_failed);
       return false;
     }
   }
-  return true;
 }
 
-bool Image::load_desc(GifIO &io) {
+bool Image::load_desc(GifIO &io, ByteView *cm_view) {
   uint8_t flags;
   if (!io.read(&rect) || !io.read(&flags)) {
     io.set_error(ErrorCode::read_failed);
@@ -869,7 +1488,14 @@ bool Image::load_desc(GifIO &io) {
   uint8_t color_res = (flags & 0x07) + 1;
   interlace = flags & 0x40;
   bool local_colormap = flags & 0x80;
-  if (local_colormap) {
+  if (cm_view) {
+    *cm_view = ByteView();
+    if (local_colormap) {
+      cm_view->len = 3 << color_res;
+      cm_view->data = io.view(cm_view->len);
+      return cm_view->data != nullptr;
+    }
+  } else if (local_colormap) {
     cm = ColorMap(color_res);
     if (!cm->load(io)) {
       cm.reset();
@@ -879,7 +1505,7 @@ bool Image::load_desc(GifIO &io) {
   return true;
 }
 
-bool Image::save_descr(GifIO &io) {
+bool Image::save_descr(GifIO &io) const {
   uint8_t intro = Gif::descriptor;
   io.write(intro);
   io.write(rect);
@@ -897,26 +1523,37 @@ bool Image::save_descr(GifIO &io) {
 
 // MARK: Gif
 
-bool Gif::load_scr_desc(GifIO &io) {
+// With cm_view the global color map is viewed in place, not loaded.
+static bool read_scr_desc(GifIO &io, Size *sz, uint8_t *bg,
+                          std::optional<ColorMap> *cm,
+                          ByteView *cm_view = nullptr) {
   uint8_t buf[3];
 
-  if (!io.read(&sz) || !io.read(buf, 3)) {
+  if (!io.read(sz) || !io.read(buf, 3)) {
     return false;
   }
 
   uint8_t color_res = (buf[0] & 0x07) + 1;
-  bg = buf[1];
+  *bg = buf[1];
 
   bool has_global_colormap = buf[0] & 0x80;
-  if (has_global_colormap) {
-    cm = ColorMap(color_res);
-    if (!cm->load(io)) {
+  if (cm_view) {
+    if (has_global_colormap) {
+      cm_view->len = 3 << color_res;
+      cm_view->data = io.view(cm_view->len);
+      return cm_view->data != nullptr;
+    }
+  } else if (has_global_colormap) {
+    *cm = ColorMap(color_res);
+    if (!(*cm)->load(io)) {
       return false;
     }
   }
   return true;
 }
 
+bool Gif::load_scr_desc(GifIO &io) { return read_scr_desc(io, &sz, &bg, &cm); }
+
 bool Gif::load(IODevice &dev, ErrorCode *err) {
   GifIO io(dev);
   GifRecordType recordType;
@@ -972,8 +1609,131 @@ bool Gif::load(IODevice &dev, ErrorCode *err) {
   return true;
 }
 
-bool Gif::save(IODevice &dev, ErrorCode *err) {
+namespace {
+
+// The LZW data of one image: code size byte and sub-blocks up to the block
+// terminator.
+struct ImageSpan {
+  std::shared_ptr<Image> img;
+  const uint8_t *data;
+  size_t len;
+  std::vector<uint8_t> copy;
+};
+
+bool copy_bits(GifIO &io, std::vector<uint8_t> *dst) {
+  uint8_t byte;
+  if (!io.read(&byte)) {
+    return false;
+  }
+  dst->push_back(byte);
+  do {
+    if (!io.read(&byte)) {
+      return false;
+    }
+    dst->push_back(byte);
+    const uint8_t *block = io.view(byte);
+    if (!block) {
+      return false;
+    }
+    dst->insert(dst->end(), block, block + byte);
+  } while (byte != 0);
+  return true;
+}
+
+}  // namespace
+
+bool Gif::load_parallel(IODevice &dev, unsigned threads) {
   GifIO io(dev);
+  GifRecordType recordType;
+  std::vector<Extension> ext_lists;
+  std::vector<ImageSpan> spans;
+  bool in_place = dev.view(0) != nullptr;
+
+  if (!io.probe()) {
+    return false;
+  }
+
+  if (!load_scr_desc(io)) {
+    io.set_error(ErrorCode::no_scrn_dscr);
+    return false;
+  }
+
+  do {
+    if (!io.read(&recordType)) {
+      io.set_error(ErrorCode::wrong_record);
+      return false;
+    }
+
+    switch (recordType) {
+      case GifRecordType::image_desc: {
+        ImageSpan span;
+        span.img = std::make_shared<Image>();
+        if (!span.img->load_desc(io)) {
+          return false;
+        }
+        if (in_place) {
+          span.data = dev.view(0);
+          if (!Image::skip_bits(io)) {
+            return false;
+          }
+          span.len = dev.view(0) - span.data;
+        } else {
+          if (!copy_bits(io, &span.copy)) {
+            io.set_error(ErrorCode::read_failed);
+            return false;
+          }
+          span.data = span.copy.data();
+          span.len = span.copy.size();
+        }
+        span.img->alloc_bits();
+
+        if (!ext_lists.empty()) {
+          span.img->set_extensions(std::move(ext_lists));
+          ext_lists.clear();
+        }
+        spans.push_back(std::move(span));
+      } break;
+
+      case GifRecordType::extension: {
+        Extension ext;
+        if (!ext.load(io)) {
+          return false;
+        }
+        ext_lists.push_back(ext);
+      } break;
+
+      default:
+        break;
+    }
+  } while (recordType != GifRecordType::terminate);
+
+  std::atomic<bool> ok{true};
+  ThreadPool pool(threads);
+  pool.parallel_for(spans.size(), [&](size_t i) {
+    const ImageSpan &span = spans[i];
+    MemDevice mem;
+    mem.open_for_read(span.data, span.len);
+    GifIO span_io(mem);
+    if (!span.img->load_bits(span_io, span.img->rbits())) {
+      ok = false;
+    }
+  });
+  if (!ok) {
+    io.set_error(ErrorCode::image_defect);
+    return false;
+  }
+
+  for (auto &span : spans) {
+    imgs.push_back(std::move(span.img));
+  }
+  if (!ext_lists.empty()) {
+    exs = std::move(ext_lists);
+  }
+  return true;
+}
+
+bool Gif::save(IODevice &dev, ErrorCode *err, size_t buffer_size) {
+  GifIO io(dev, buffer_size);
 
   if (!save_scr_desc(io)) {
     return false;
@@ -992,8 +1752,193 @@ bool Gif::save(IODevice &dev, ErrorCode *err) {
   return io.write_terminator();
 }  // namespace gif
 
+void Gif::reduce_palette() {
+  if (!cm) {
+    return;
+  }
+  bool used[256] = {};
+  used[bg] = true;
+  for (auto &img : imgs) {
+    if (img->color_map()) {
+      continue;
+    }
+    const uint8_t *p = img->bits();
+    size_t n = (size_t)img->size().width() * img->size().height();
+    for (size_t i = 0; i < n; ++i) {
+      used[p[i]] = true;
+    }
+    // A transparent color keeps its index even where no pixel has it, so
+    // remap_colors() has a place to send it.
+    for (auto &ext : img->extensions()) {
+      int color = ext.transparent_color();
+      if (color >= 0) {
+        used[color] = true;
+      }
+    }
+  }
+
+  auto &colors = cm->colors();
+  std::vector<RGB> reduced;
+  uint8_t remap[256] = {};
+  for (unsigned i = 0; i < 256; ++i) {
+    if (used[i]) {
+      remap[i] = reduced.size();
+      reduced.push_back(i < colors.size() ? colors[i] : RGB());
+    }
+  }
+  uint8_t color_res = 1;
+  while ((1u << color_res) < reduced.size()) {
+    color_res++;
+  }
+  if (color_res >= cm->color_res()) {
+    return;
+  }
+
+  for (auto &img : imgs) {
+    if (!img->color_map()) {
+      img->remap_colors(remap);
+    }
+  }
+  bg = remap[bg];
+  cm = ColorMap(color_res, reduced);
+}
+
 void Gif::append(std::unique_ptr<Image> image) {
   imgs.push_back(std::move(image));
 }
 
+// MARK: GifReader
+
+bool GifReader::open() {
+  if (!io.probe()) {
+    return false;
+  }
+  if (!read_scr_desc(io, &sz, &bg, &cm, views ? &cm_view : nullptr)) {
+    io.set_error(ErrorCode::no_scrn_dscr);
+    return false;
+  }
+  return true;
+}
+
+// The sub-blocks of an extension, after its introducer, as views.
+static bool view_extension(GifIO &io, ExtensionView *ext) {
+  uint8_t fn;
+  if (!io.read(&fn)) {
+    io.set_error(ErrorCode::read_failed);
+    return false;
+  }
+  ext->function = (Extension::FuncCode)fn;
+  ext->chunks.clear();
+  for (;;) {
+    uint8_t size;
+    if (!io.read(&size)) {
+      io.set_error(ErrorCode::read_failed);
+      return false;
+    }
+    if (size == 0) {
+      return true;
+    }
+    ByteView chunk;
+    chunk.data = io.view(size);
+    chunk.len = size;
+    if (!chunk.data) {
+      io.set_error(ErrorCode::read_failed);
+      return false;
+    }
+    ext->chunks.push_back(chunk);
+  }
+}
+
+bool GifReader::next() {
+  if (done) {
+    return false;
+  }
+  if (pending) {
+    pending = false;
+    if (!Image::skip_bits(io)) {
+      return false;
+    }
+  }
+
+  exts.clear();
+  ext_views.clear();
+  for (;;) {
+    GifRecordType record_type;
+    if (!io.read(&record_type)) {
+      return false;
+    }
+    switch (record_type) {
+      case GifRecordType::extension:
+        if (views) {
+          ExtensionView ext;
+          if (!view_extension(io, &ext)) {
+            return false;
+          }
+          ext_views.push_back(std::move(ext));
+        } else {
+          Extension ext;
+          if (!ext.load(io)) {
+            return false;
+          }
+          exts.push_back(std::move(ext));
+        }
+        break;
+
+      case GifRecordType::image_desc:
+        frame = Image();
+        if (!frame.load_desc(io, views ? &frame_cm_view : nullptr)) {
+          return false;
+        }
+        frame.set_extensions(std::move(exts));
+        exts.clear();
+        frame_ext_views.swap(ext_views);
+        ext_views.clear();
+        count++;
+        pending = true;
+        return true;
+
+      case GifRecordType::terminate:
+        done = true;
+        return false;
+
+      default:
+        io.set_error(ErrorCode::wrong_record);
+        return false;
+    }
+  }
+}
+
+bool GifReader::read_pixels(uint8_t *dst) {
+  if (!pending) {
+    return false;
+  }
+  pending = false;
+  return frame.load_bits(io, dst);
+}
+
+// MARK: GifWriter
+
+bool GifWriter::open(const Size &size, uint8_t background,
+                     const std::optional<ColorMap> &color_map) {
+  cm = color_map;
+  return write_scr_desc(io, size, background, cm) && io.flush();
+}
+
+// Each frame goes to the device as soon as it is done, but the device's
+// own buffers are only synced on close(): unbuffered devices such as pipes
+// pass every frame on right away, an async file keeps writing in bulk.
+bool GifWriter::write(const Image &img) {
+  return img.save(io, cm) && io.flush();
+}
+
+bool GifWriter::write(const Extension &ext) {
+  if (!ext.save(io)) {
+    io.set_error(ErrorCode::write_failed);
+    return false;
+  }
+  return true;
+}
+
+bool GifWriter::close() { return io.write_terminator() && io.sync(); }
+
 }  // namespace gif
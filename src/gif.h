@@ -10,7 +10,12 @@ namespace gif {
 
 class IODevice {
  public:
-  enum OpenMode { not_open = 0x0000, read_only = 0x0001, write_only = 0x0002 };
+  enum OpenMode {
+    not_open = 0x0000,
+    read_only = 0x0001,
+    write_only = 0x0002,
+    async_write = 0x0006  // write_only, with the writes on a background thread
+  };
 
   IODevice() : m(not_open) {}
   virtual ~IODevice(){};
@@ -20,6 +25,15 @@ class IODevice {
 
   virtual size_t read(void *buf, size_t len) = 0;
   virtual size_t write(const void *buf, size_t len) = 0;
+  // Devices that hold all their data in memory hand out the next len bytes
+  // in place and move past them; the others return nullptr.
+  virtual const uint8_t *view(size_t /*len*/) { return nullptr; }
+  virtual bool skip(size_t len);
+  // Pushes out whatever the device itself still buffers.
+  virtual bool flush() { return true; }
+  // Ends the use of the device; false if what it still held couldn't be
+  // written out.
+  virtual bool close() { return true; }
 
  protected:
   OpenMode m;
@@ -27,24 +41,69 @@ class IODevice {
 
 class FileDevice : public IODevice {
  public:
-  FileDevice(const std::string &name) : n(name), f(0) {}
+  FileDevice(const std::string &name);
   ~FileDevice() override;
 
   bool open(OpenMode mode);
   size_t read(void *buf, size_t len) override;
   size_t write(const void *buf, size_t len) override;
+  bool skip(size_t len) override;
+  bool flush() override;
+  bool close() override;
 
  private:
-  void close();
+  class Writer;
 
   std::string n;
   FILE *f;
+  std::unique_ptr<Writer> w;
+};
+
+// Reads and writes a file descriptor it doesn't own: stdout, a pipe or a
+// socket to a local consumer. Writes aren't buffered.
+class FdDevice : public IODevice {
+ public:
+  FdDevice(int descriptor, OpenMode mode) : fd(descriptor) { m = mode; }
+
+  size_t read(void *buf, size_t len) override;
+  size_t write(const void *buf, size_t len) override;
+
+ private:
+  int fd;
+};
+
+// Maps the whole file read-only, so loading reads straight from the page
+// cache. Where mmap isn't available the file is read into memory instead.
+class MmapDevice : public IODevice {
+ public:
+  MmapDevice(const std::string &name)
+      : n(name), d(nullptr), l(0), p(0), mapped(false) {}
+  ~MmapDevice() override;
+
+  bool open();
+  size_t read(void *buf, size_t len) override;
+  size_t write(const void *buf, size_t len) override;
+  const uint8_t *view(size_t len) override;
+  bool skip(size_t len) override { return view(len) != nullptr; }
+  size_t size() const { return l; }
+  bool close() override;
+
+ private:
+
+  std::string n;
+  const uint8_t *d;
+  size_t l;
+  size_t p;
+  bool mapped;
+  std::vector<uint8_t> copy;
 };
 
 class MemDevice : public IODevice {
  public:
   size_t read(void *buf, size_t len) override;
   size_t write(const void *buf, size_t len) override;
+  const uint8_t *view(size_t len) override;
+  bool skip(size_t len) override { return view(len) != nullptr; }
 
   int open_for_read(const uint8_t *src, size_t len);
   void open_for_write(uint8_t *dst, size_t maxLen);
@@ -61,6 +120,30 @@ class MemDevice : public IODevice {
   size_t l;
 };
 
+// A write-only sink that keeps the GIF in memory and grows as needed. An
+// arena given to open() is filled first; past its end the data moves to an
+// owned buffer that grows geometrically.
+class BufferDevice : public IODevice {
+ public:
+  BufferDevice() : d(nullptr), l(0), cap(0) {}
+
+  void open(uint8_t *arena = nullptr, size_t arena_len = 0);
+  size_t read(void *buf, size_t len) override;
+  size_t write(const void *buf, size_t len) override;
+
+  const uint8_t *data() const { return d; }
+  size_t size() const { return l; }
+  bool in_arena() const { return d && d != own.data(); }
+  // Hands the bytes over, without a copy unless they're still in the arena.
+  std::vector<uint8_t> take();
+
+ private:
+  uint8_t *d;
+  size_t l;
+  size_t cap;
+  std::vector<uint8_t> own;
+};
+
 class Size {
  public:
   Size() : wd(0), ht(0) {}
@@ -160,12 +243,28 @@ enum class ErrorCode {
 
 enum GifRecordType { undefined, screen_desc, image_desc, extension, terminate };
 
+// Writes are collected in a buffer and go to the device in bulk when it
+// fills up or on flush(); reads go straight to the device.
 class GifIO {
  public:
-  GifIO(IODevice &dev) : e(ErrorCode::ok), d(dev) {}
+  enum { default_buffer_size = 64 * 1024 };
+
+  GifIO(IODevice &dev, size_t buffer_size = default_buffer_size)
+      : e(ErrorCode::ok),
+        d(dev),
+        out_cap(buffer_size < 256 ? 256 : buffer_size),
+        out_len(0) {}
+  ~GifIO() { flush(); }
+  GifIO(GifIO const &) = delete;
+  GifIO &operator=(GifIO const &) = delete;
+
   bool probe();
   bool write_terminator();
+  // flush() plus the device's own buffers, so that a reader on the other
+  // end sees everything written so far.
+  bool sync() { return flush() && d.flush(); }
   void set_error(ErrorCode err) { e = err; }
+  ErrorCode error() const { return e; }
 
   bool read(uint8_t *buf, size_t len);
   bool read(uint8_t *byte);
@@ -175,6 +274,11 @@ class GifIO {
   bool read(Point *pos);
   bool read(Rect *rect);
   bool read(GifRecordType *record_type);
+  // The next len bytes: in place if the device allows it, otherwise copied
+  // into a scratch buffer that is valid until the next view(). nullptr on
+  // a short read.
+  const uint8_t *view(size_t len);
+  bool skip(size_t len) { return d.skip(len); }
 
   bool write(const uint8_t *buf, size_t len);
   bool write(uint8_t byte);
@@ -184,9 +288,20 @@ class GifIO {
   bool write(const Point &pos);
   bool write(const Rect &rect);
 
+  // Hands out room for len bytes (at most the buffer size) in the output
+  // buffer to be filled in place and then committed, or nullptr if the
+  // buffer couldn't be flushed.
+  uint8_t *reserve(size_t len);
+  void commit(size_t len) { out_len += len; }
+  bool flush();
+
  private:
   ErrorCode e;
   IODevice &d;
+  std::vector<uint8_t> out;
+  size_t out_cap;
+  size_t out_len;
+  std::vector<uint8_t> in;
 };
 
 using ExtensionChunk = std::vector<uint8_t>;
@@ -206,40 +321,63 @@ class Extension {
   void append(const std::vector<uint8_t> &data);
 
   bool load(GifIO &io);
-  bool save(GifIO &io);
+  bool save(GifIO &io) const;
 
   FuncCode function() const { return fn; }
 
   bool empty() const { return list.empty(); }
 
+  // The transparent color index of a graphics control extension that
+  // sets one, -1 otherwise.
+  int transparent_color() const;
+  // Keeps the transparent color of a graphics control extension pointing
+  // at the same color when the color indices are remapped.
+  void remap_colors(const uint8_t *remap);
+
  private:
   bool load_chunk(GifIO &io, ExtensionChunk *chunk, bool *last);
-  bool save_chunk(GifIO &io, const ExtensionChunk &chunk);
+  bool save_chunk(GifIO &io, const ExtensionChunk &chunk) const;
 
-  bool save_leader(GifIO &io);
-  bool save_trailer(GifIO &io);
+  bool save_leader(GifIO &io) const;
+  bool save_trailer(GifIO &io) const;
 
   FuncCode fn = next;
   std::vector<ExtensionChunk> list;
 };
 
+// create_delay_mark() adds this to every delay, so each frame is shown for
+// at least 2/100 s.
+constexpr uint16_t delay_padding = 2;
+
 Extension create_animation_mark(uint16_t replays);
 Extension create_delay_mark(uint16_t delay);
 
 class ColorMap {
  public:
   ColorMap(uint8_t color_res) : r(color_res) {}
+  ColorMap(uint8_t color_res, const std::vector<RGB> &colors)
+      : r(color_res), c(colors) {
+    c.resize(1 << r);
+  }
 
   uint8_t color_res() const { return r; }
+  const std::vector<RGB> &colors() const { return c; }
 
   bool load(GifIO &io);
-  bool save(GifIO &io);
+  bool save(GifIO &io) const;
 
  private:
   uint8_t r;  // number of colors = 2^color_res; maximum 2^8 = 256 colors
   std::vector<RGB> c;
 };
 
+// Bytes in the memory of a device that keeps all its data there, handed
+// out in place; valid for as long as the device stays open.
+struct ByteView {
+  const uint8_t *data = nullptr;
+  size_t len = 0;
+};
+
 class Image {
  public:
   Image() {}
@@ -262,18 +400,32 @@ class Image {
   }
 
   Size size() const { return rect.size(); }
+  Point pos() const { return rect.pos(); }
+  bool interlaced() const { return interlace; }
+  const std::optional<ColorMap> &color_map() const { return cm; }
+  const std::vector<Extension> &extensions() const { return exts; }
+  void remap_colors(const uint8_t *remap);
+  uint64_t hash() const;
+  bool same_bits(const Image &other) const;
   void set_extensions(const std::vector<Extension> &extensions) {
     exts = extensions;
   }
   void set_extensions(std::vector<Extension> &&extensions) {
     exts = std::move(extensions);
   }
-  bool save(GifIO &io, std::optional<ColorMap> global_colormap);
+  bool save(GifIO &io, const std::optional<ColorMap> &global_colormap) const;
   bool load(GifIO &io);
+  // The two halves of load(): the descriptor with the local color map, then
+  // the image data, decoded into width * height bytes at dst or skipped.
+  // With cm_view the local color map isn't loaded; cm_view gets its RGB
+  // triplets in place instead, or stays empty if there is none.
+  bool load_desc(GifIO &io, ByteView *cm_view = nullptr);
+  bool load_bits(GifIO &io, uint8_t *dst) const;
+  static bool skip_bits(GifIO &io);
+  void alloc_bits() { b.resize(rect.area()); }
 
  private:
-  bool load_desc(GifIO &io);
-  bool save_descr(GifIO &io);
+  bool save_descr(GifIO &io) const;
 
   bool interlace = false;
   std::vector<Extension> exts;
@@ -297,12 +449,24 @@ class Gif {
   std::optional<ColorMap> color_map() const { return cm; }
 
   bool load(IODevice &dev, ErrorCode *err = nullptr);
-  bool save(IODevice &dev, ErrorCode *err = nullptr);
+  // Indexes the image data first, then decodes the frames on a pool of
+  // threads (0 picks one per core). Image data is used in place on memory
+  // and mmap devices and copied out of the others.
+  bool load_parallel(IODevice &dev, unsigned threads = 0);
+  // buffer_size is that of the GifIO output buffer; at its minimum every
+  // LZW sub-block goes to the device on its own.
+  bool save(IODevice &dev, ErrorCode *err = nullptr,
+            size_t buffer_size = GifIO::default_buffer_size);
 
   void append(std::unique_ptr<Image> image);
 
   const std::vector<std::shared_ptr<Image>> &images() const { return imgs; }
 
+  // Drops the global colors no image uses and renumbers the rest, so the
+  // color table and the LZW codes get as narrow as possible. Images with
+  // a local color map keep it.
+  void reduce_palette();
+
  private:
   bool load_scr_desc(GifIO &io);
   bool save_scr_desc(GifIO &io);
@@ -314,6 +478,100 @@ class Gif {
   std::optional<ColorMap> cm;
 };
 
+// An extension as it is in the device's memory: its function code and the
+// data of its sub-blocks.
+struct ExtensionView {
+  Extension::FuncCode function;
+  std::vector<ByteView> chunks;
+};
+
+// Reads a GIF one frame at a time in constant memory. next() stops at the
+// next image descriptor, having read the extensions before it; the frame's
+// pixels are then decoded by read_pixels() or skipped without decoding by
+// the following next().
+//
+// With in_place on a device that keeps all its data in memory (MemDevice,
+// MmapDevice) nothing but the pixels is copied: the color maps and the
+// extensions are only handed out as views into the device, and the
+// ColorMap and Extension accessors stay empty. On other devices in_place
+// has no effect and the views stay empty.
+class GifReader {
+ public:
+  GifReader(IODevice &dev, bool in_place = false)
+      : io(dev), views(in_place && dev.view(0) != nullptr) {}
+
+  // Reads the header and the logical screen descriptor.
+  bool open();
+  // False at the end of the stream (at_end()) or on an error (error()).
+  bool next();
+  bool read_pixels(uint8_t *dst);
+
+  bool at_end() const { return done; }
+  ErrorCode error() const { return io.error(); }
+
+  Size size() const { return sz; }
+  uint8_t background() const { return bg; }
+  const std::optional<ColorMap> &color_map() const { return cm; }
+
+  // The current frame; its pixels are only in the caller's buffer.
+  size_t frame_number() const { return count - 1; }
+  Point frame_pos() const { return frame.pos(); }
+  Size frame_size() const { return frame.size(); }
+  bool interlaced() const { return frame.interlaced(); }
+  const std::optional<ColorMap> &frame_color_map() const {
+    return frame.color_map();
+  }
+  // The frame's extensions, or after the end the ones behind the last frame.
+  const std::vector<Extension> &extensions() const {
+    return done ? exts : frame.extensions();
+  }
+
+  bool in_place() const { return views; }
+  // The RGB triplets of the global and the frame's color map.
+  ByteView color_map_view() const { return cm_view; }
+  ByteView frame_color_map_view() const { return frame_cm_view; }
+  const std::vector<ExtensionView> &extension_views() const {
+    return done ? ext_views : frame_ext_views;
+  }
+
+ private:
+  GifIO io;
+  bool views;
+  Size sz;
+  uint8_t bg = 0;
+  std::optional<ColorMap> cm;
+  Image frame;
+  std::vector<Extension> exts;
+  ByteView cm_view;
+  ByteView frame_cm_view;
+  std::vector<ExtensionView> ext_views;
+  std::vector<ExtensionView> frame_ext_views;
+  size_t count = 0;
+  bool pending = false;
+  bool done = false;
+};
+
+// Writes a GIF while it's being made: the screen descriptor on open(), then
+// frames one at a time, each handed to the device right away, and the
+// terminator on close(), which syncs the device. Memory use doesn't grow
+// with the frame count.
+class GifWriter {
+ public:
+  GifWriter(IODevice &dev) : io(dev) {}
+
+  bool open(const Size &size, uint8_t background,
+            const std::optional<ColorMap> &color_map);
+  bool write(const Image &img);
+  bool write(const Extension &ext);
+  bool close();
+
+  ErrorCode error() const { return io.error(); }
+
+ private:
+  GifIO io;
+  std::optional<ColorMap> cm;
+};
+
 }  // namespace gif
 
 #endif  // GIF_H
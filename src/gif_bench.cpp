@@ -0,0 +1,157 @@
+// Renders a game of snake into a GIF in memory, loads it back and times
+// saving its frames again, which is LZW encoding for the most part:
+//   snake_gif_bench [size=WxH] [frames=N] [cell=N] [rounds=N]
+//                   [buffer=BYTES] [sink=mem|null] [out=FILE]
+// buffer is the GifIO output buffer, 64 KiB by default; 0 sends every LZW
+// sub-block to the device on its own, as before GifIO buffered. The sink
+// is a buffer in memory, or /dev/null through a write() per device write.
+// It is built with and without the run-length fast path of the LZW
+// encoder; the GIFs the two write out for the same arguments have to be
+// the same byte for byte.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <regex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "ai.h"
+#include "game.h"
+#include "gif.h"
+#include "render.h"
+
+#ifdef GIF_LZW_NO_RUNS
+const char *runs = "off";
+#else
+const char *runs = "on";
+#endif
+
+// Plays hamilton for up to max_frames moves, every move a frame.
+std::vector<uint8_t> render_game(const Size &sz, size_t max_frames,
+                                 unsigned cell_size) {
+  gif::BufferDevice dev;
+  dev.open();
+  Game game(sz);
+  auto ai = create_ai("hamilton", game);
+  GameRender r(game, cell_size);
+  r.stream_to(dev);
+  size_t c = 0;
+  do {
+    r.draw_frame(4);
+    ai->next_move();
+  } while (++c < max_frames && !game.is_over() &&
+           !(game.is_looping() && ai->decides_by_state()));
+  r.draw_frame(100);
+  r.draw_game_over(100);
+  r.finish();
+  return dev.take();
+}
+
+// FNV-1a, to tell the outputs apart at a glance.
+uint64_t checksum(const uint8_t *data, size_t len) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ data[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+int main(int argc, char **argv) {
+  Size size(40, 30);
+  size_t frames = 3000;
+  unsigned cell = 16;
+  unsigned rounds = 3;
+  size_t buffer = gif::GifIO::default_buffer_size;
+  bool null_sink = false;
+  std::string out;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::smatch m;
+    if (std::regex_match(arg, m, std::regex("size=(\\d+)x(\\d+)"))) {
+      size = Size(std::max(std::stoi(m[1]), 4), std::max(std::stoi(m[2]), 4));
+    } else if (std::regex_match(arg, m, std::regex("frames=(\\d+)"))) {
+      frames = std::max(std::stoi(m[1]), 1);
+    } else if (std::regex_match(arg, m, std::regex("cell=(1|2|4|8|16)"))) {
+      cell = std::stoi(m[1]);
+    } else if (std::regex_match(arg, m, std::regex("rounds=(\\d+)"))) {
+      rounds = std::max(std::stoi(m[1]), 1);
+    } else if (std::regex_match(arg, m, std::regex("buffer=(\\d+)"))) {
+      buffer = std::stoul(m[1]);
+    } else if (std::regex_match(arg, m, std::regex("sink=(mem|null)"))) {
+      null_sink = m[1] == "null";
+    } else if (std::regex_match(arg, m, std::regex("out=(.+)"))) {
+      out = m[1];
+    } else {
+      std::fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  auto rendered = render_game(size, frames, cell);
+  gif::MemDevice src;
+  src.open_for_read(rendered.data(), rendered.size());
+  gif::Gif gif;
+  if (!gif.load(src)) {
+    std::fprintf(stderr, "can't load the rendered GIF\n");
+    return 1;
+  }
+  double pixels = 0;
+  for (auto &img : gif.images()) {
+    pixels += img->size().area();
+  }
+
+  // The output goes to an arena that has room for it, so the rounds time
+  // the encoder rather than the allocator; the fastest one counts.
+  std::vector<uint8_t> arena(rendered.size() * 2);
+  gif::BufferDevice dev;
+  int null_fd = null_sink ? open("/dev/null", O_WRONLY) : -1;
+  gif::FdDevice null_dev(null_fd, gif::IODevice::write_only);
+  double best = 0;
+  for (unsigned i = 0; i < rounds; i++) {
+    dev.open(arena.data(), arena.size());
+    auto start = std::chrono::steady_clock::now();
+    if (!gif.save(null_sink ? static_cast<gif::IODevice &>(null_dev) : dev,
+                  nullptr, buffer)) {
+      std::fprintf(stderr, "can't save the GIF\n");
+      return 1;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (i == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+
+  // What went to /dev/null is saved once more to be summed up.
+  if (null_sink) {
+    close(null_fd);
+    if (!gif.save(dev)) {
+      std::fprintf(stderr, "can't save the GIF\n");
+      return 1;
+    }
+  }
+
+  std::printf("%-4s %-5s %7s %6s %10s %10s %10s %12s %16s\n", "runs", "sink",
+              "buffer", "frames", "pixels", "gif size", "MB/s", "Mpixels/s",
+              "checksum");
+  std::printf(
+      "%-4s %-5s %7zu %6zu %9.1fM %8.1fMB %10.1f %12.1f %016llx\n", runs,
+      null_sink ? "null" : "mem", buffer,
+      gif.images().size(), pixels * 1e-6, dev.size() * 1e-6,
+      dev.size() * 1e-6 / best, pixels * 1e-6 / best,
+      (unsigned long long)checksum(dev.data(), dev.size()));
+
+  if (!out.empty()) {
+    gif::FileDevice file(out);
+    if (!file.open(gif::IODevice::write_only) ||
+        file.write(dev.data(), dev.size()) != dev.size() || !file.close()) {
+      std::fprintf(stderr, "can't write %s\n", out.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <regex>
 #include <sstream>
 
@@ -8,41 +10,172 @@
 #include "gif.h"
 #include "render.h"
 
-void generate_gif(const Size& sz, size_t max_frames) {
-  std::ostringstream ss;
-  ss << "snake" << sz.width() << "x" << sz.height() << ".gif";
-  gif::FileDevice dev(ss.str());
-  dev.open(gif::FileDevice::write_only);
+int frame_delay(const Game &game) {
+  int max_score = game.field().size().area() - 3;
+  int max_delay = 15;
+  return double(max_score - game.score()) / max_score * max_delay;
+}
 
-  Game game(sz);
-  GameAI ai(game);
-  GameRender r(game);
+Dir move_dir(const Field &field, int from, int to) {
+  for (auto dir : {Dir::Left, Dir::Right, Dir::Up, Dir::Down}) {
+    if (field.can_move(from, dir) && from + field.move_value(dir) == to) {
+      return dir;
+    }
+  }
+  return Dir::Err;
+}
 
-  int max_score = sz.area() - 3;
-  int max_delay = 15;
-  int c = 0;
+// Plays the game without drawing it, for the time-lapse modes that have to
+// know its length in advance. Returns the moves, Dir::Err where the snake
+// didn't move, the play time of the full animation in 1/100 s and the
+// cookies eaten. Like the drawn game, it ends once the snake goes round in
+// a loop it can't leave.
+std::vector<Dir> record_game(const Size &sz, size_t max_frames,
+                             const std::string &ai_name, long budget,
+                             long *duration, int *cookies) {
+  Game game(sz);
+  auto ai = create_ai(ai_name, game);
+  ai->set_work_budget(budget);
+  std::vector<Dir> moves;
+  *duration = 2 * (100 + gif::delay_padding);
+  size_t c = 0;
   do {
     if (c++ > max_frames) {
       break;
     }
-    int delay = double(max_score -  game.score()) / max_score * max_delay;
-    r.draw_frame(delay);
-    ai.next_move();
-  } while (!game.is_over());
+    *duration += frame_delay(game) + gif::delay_padding;
+    int head = game.snake().head();
+    ai->next_move();
+    moves.push_back(move_dir(game.field(), head, game.snake().head()));
+  } while (!game.is_over() &&
+           !(game.is_looping() && ai->decides_by_state()));
+  *cookies = game.score();
+  return moves;
+}
+
+struct TimeLapse {
+  size_t every = 1;       // draw every Nth move
+  size_t frames = 0;      // or about this many frames
+  unsigned duration = 0;  // seconds, squeezes the delays to fit
+};
+
+// "-" is stdout; no name means snakeWxH.gif.
+std::unique_ptr<gif::IODevice> open_output(const std::string &out,
+                                           const Size &sz) {
+  if (out == "-") {
+    return std::make_unique<gif::FdDevice>(1, gif::IODevice::write_only);
+  }
+  std::string name = out;
+  if (name.empty()) {
+    std::ostringstream ss;
+    ss << "snake" << sz.width() << "x" << sz.height() << ".gif";
+    name = ss.str();
+  }
+  auto file = std::make_unique<gif::FileDevice>(name);
+  if (!file->open(gif::FileDevice::async_write)) {
+    return nullptr;
+  }
+  return file;
+}
+
+bool generate_gif(const Size &sz, size_t max_frames, unsigned cell_size,
+                  TimeLapse lapse, bool min_palette, const std::string &out,
+                  const std::string &ai_name, long budget) {
+  auto dev = open_output(out, sz);
+  if (!dev) {
+    return false;
+  }
+
+  Game game(sz);
+  GameRender r(game, cell_size);
+  // The minimal palette is only known once every frame is drawn, so that
+  // mode keeps the frames until save().
+  r.set_min_palette(min_palette);
+  if (!min_palette) {
+    r.stream_to(*dev);
+  }
+
+  // A time-lapse replays a recorded game; only a live one needs the AI.
+  std::unique_ptr<SnakeAI> ai;
+  std::vector<Dir> replay;
+  bool cookie_frames = true;
+  bool replaying = lapse.frames || lapse.duration;
+  if (!replaying) {
+    ai = create_ai(ai_name, game);
+    ai->set_work_budget(budget);
+  } else {
+    long natural_duration;
+    int cookies;
+    replay = record_game(sz, max_frames, ai_name, budget, &natural_duration,
+                         &cookies);
+    if (lapse.duration) {
+      r.set_time_scale(lapse.duration * 100.0 / natural_duration);
+      if (!lapse.frames) {
+        lapse.frames = lapse.duration * 25;
+      }
+    }
+    // The frames of the cookies eaten come out of the target; when they
+    // alone would go over it, they are drawn only where the others are.
+    size_t others = lapse.frames;
+    if (size_t(cookies) < lapse.frames) {
+      others -= cookies;
+    } else {
+      cookie_frames = false;
+    }
+    lapse.every =
+        std::max<size_t>(1, (replay.size() + others - 1) / others);
+  }
+
+  // The first frame and, unless a time-lapse has too many of them, the
+  // ones showing a cookie just eaten are always drawn, the last ones are
+  // drawn after the loop. A snake going round in a loop that its AI can't
+  // leave would only repeat the same frames up to max_frames, so the game
+  // ends there; a replay ends with the recorded moves.
+  int score = game.score();
+  size_t c = 0;
+  do {
+    if (c > max_frames) {
+      break;
+    }
+    int delay = frame_delay(game);
+    if (c % lapse.every == 0 || (cookie_frames && game.score() != score)) {
+      r.draw_frame(delay);
+    } else {
+      r.skip_frame(delay);
+    }
+    score = game.score();
+    if (!replaying) {
+      ai->next_move();
+    } else if (replay[c] != Dir::Err) {
+      bool cookie_eaten;
+      game.move(replay[c], &cookie_eaten);
+    }
+    c++;
+  } while (replaying ? c < replay.size()
+                     : !game.is_over() &&
+                           !(game.is_looping() && ai->decides_by_state()));
 
   r.draw_frame(100);
   r.draw_game_over(100);
-  r.save(dev);
+  bool ok = min_palette ? r.save(*dev) : r.finish();
+  return dev->close() && ok;
 }
 
 struct Params {
   Size field_size = {13, 8};
   int max_frames = 3000;
+  unsigned cell_size = 16;
+  TimeLapse lapse;
+  bool min_palette = false;
+  std::string out;
+  std::string ai = "waves";
+  long budget = 0;
 
   void parse(int argc, char** argv) {
     std::string args;
     for (int i = 1; i < argc; i++) {
       args += argv[i];
+      args += " ";
     }
     std::smatch sz_match;
     std::regex_search(args, sz_match, std::regex("size\\s*=\\s*(\\d+)x(\\d+)"));
@@ -55,12 +188,82 @@ struct Params {
     if (mf_match.size() == 2) {
       max_frames = std::stoi(mf_match[1]);
     }
+    std::smatch cs_match;
+    std::regex_search(args, cs_match, std::regex("\\bcell\\s*=\\s*(\\d+)"));
+    if (cs_match.size() == 2) {
+      cell_size = std::stoi(cs_match[1]);
+    }
+    fit_cell_size();
+    std::smatch tl_match;
+    std::regex_search(args, tl_match, std::regex("\\blapse\\s*=\\s*(\\d+)"));
+    if (tl_match.size() == 2) {
+      lapse.every = std::max(std::stoi(tl_match[1]), 1);
+    }
+    std::smatch fr_match;
+    std::regex_search(args, fr_match, std::regex("\\bframes\\s*=\\s*(\\d+)"));
+    if (fr_match.size() == 2) {
+      lapse.frames = std::max(std::stoi(fr_match[1]), 1);
+    }
+    std::smatch du_match;
+    std::regex_search(args, du_match,
+                      std::regex("\\bduration\\s*=\\s*(\\d+)"));
+    if (du_match.size() == 2) {
+      lapse.duration = std::max(std::stoi(du_match[1]), 1);
+    }
+    min_palette = std::regex_search(
+        args, std::regex("\\bpalette\\s*=\\s*min\\b"));
+    std::smatch out_match;
+    std::regex_search(args, out_match, std::regex("\\bout\\s*=\\s*(\\S+)"));
+    if (out_match.size() == 2) {
+      out = out_match[1];
+    }
+    std::smatch ai_match;
+    std::regex_search(args, ai_match, std::regex("\\bai\\s*=\\s*(\\w+)"));
+    if (ai_match.size() == 2) {
+      ai = ai_match[1];
+    }
+    std::smatch bu_match;
+    std::regex_search(args, bu_match, std::regex("\\bbudget\\s*=\\s*(\\d+)"));
+    if (bu_match.size() == 2) {
+      budget = std::stol(bu_match[1]);
+    }
+  }
+
+  // Cells are 1, 2, 4, 8 or 16 pixels wide, and the whole frame with its
+  // border must fit into the 16-bit GIF dimensions.
+  void fit_cell_size() {
+    unsigned cs = 16;
+    while (cs > 1 && cs > cell_size) {
+      cs /= 2;
+    }
+    auto fits = [this](unsigned c) {
+      return (field_size.width() + 2) * c <= 0xffff &&
+             (field_size.height() + 2) * c <= 0xffff;
+    };
+    while (cs > 1 && !fits(cs)) {
+      cs /= 2;
+    }
+    if (!fits(cs)) {
+      field_size = Size(std::min(field_size.width(), 0xffff - 2),
+                        std::min(field_size.height(), 0xffff - 2));
+    }
+    cell_size = cs;
   }
 };
 
 int main(int argc, char** argv) {
   Params params;
   params.parse(argc, argv);
-  generate_gif(params.field_size, params.max_frames);
+  auto &names = ai_names();
+  if (std::find(names.begin(), names.end(), params.ai) == names.end()) {
+    std::cerr << "unknown ai: " << params.ai << "\n";
+    return 1;
+  }
+  if (!generate_gif(params.field_size, params.max_frames, params.cell_size,
+                    params.lapse, params.min_palette, params.out,
+                    params.ai, params.budget)) {
+    std::cerr << "failed to write the gif\n";
+    return 1;
+  }
   return 0;
 }
@@ -1,5 +1,7 @@
 #include "render.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <iostream>
 
@@ -102,7 +104,7 @@ gif::Point pos16x16(unsigned x, unsigned y) {
 
 gif::Point pos8x8(unsigned x, unsigned y) { return gif::Point(x * 8, y * 8); }
 
-Sprites::Sprites() {
+Sprites::Sprites(unsigned cell_size) {
   gif::Size s16x16(16, 16);
   gif::Size s8x8(8, 8);
 
@@ -148,6 +150,77 @@ Sprites::Sprites() {
   rects[Digits + 8] = gif::Rect(pos8x8(8, 8), s8x8);
   rects[Digits + 9] = gif::Rect(pos8x8(9, 8), s8x8);
   rects[GameOver] = gif::Rect(pos16x16(4, 0), gif::Size(12 * 8, 8 * 8));
+
+  // Full size cells are drawn straight from the sheet.
+  if (cell_size < 16) {
+    scale_cells(16 / cell_size);
+  }
+}
+
+bool is_cell_sprite(uint8_t sprite) {
+  return sprite == Brick || sprite == Cookie || sprite >= Head;
+}
+
+const gif::Image &Sprites::image(uint8_t sprite) const {
+  return is_cell_sprite(sprite) && cells.size().area() ? cells : image();
+}
+
+// Builds the cell sprites (the 4x4 block of 16x16 sprites in the top left
+// corner of the sheet) shrunk by the given factor. A block of
+// factor x factor pixels stays field colored unless at least a quarter of it
+// is covered by the sprite, otherwise it gets the palette color closest to
+// the average of the covered pixels.
+void Sprites::scale_cells(unsigned factor) {
+  const unsigned sheet_cells = 4 * 16;
+  const unsigned side = sheet_cells / factor;
+  auto &src = image();
+  auto cm = color_map();
+  auto &palette = cm.colors();
+  cells = gif::Image(gif::Size(side, side));
+  for (unsigned y = 0; y < side; ++y) {
+    for (unsigned x = 0; x < side; ++x) {
+      unsigned r = 0, g = 0, b = 0, n = 0;
+      for (unsigned j = 0; j < factor; ++j) {
+        auto s = src.bits(x * factor, y * factor + j);
+        for (unsigned i = 0; i < factor; ++i) {
+          if (s[i] != field_clr) {
+            r += palette[s[i]].r();
+            g += palette[s[i]].g();
+            b += palette[s[i]].b();
+            n++;
+          }
+        }
+      }
+      uint8_t color = field_clr;
+      if (n > 0 && n * 4 >= factor * factor) {
+        r /= n;
+        g /= n;
+        b /= n;
+        unsigned best = ~0u;
+        for (unsigned c = 0; c < palette.size(); ++c) {
+          if (c == field_clr || c == trans_clr) continue;
+          int dr = palette[c].r() - (int)r;
+          int dg = palette[c].g() - (int)g;
+          int db = palette[c].b() - (int)b;
+          unsigned dist = dr * dr + dg * dg + db * db;
+          if (dist < best) {
+            best = dist;
+            color = c;
+          }
+        }
+      }
+      *cells.rbits(x, y) = color;
+    }
+  }
+
+  cell_sz.set(cell_sz.width() / factor, cell_sz.height() / factor);
+  for (unsigned i = 0; i < 64; ++i) {
+    if (is_cell_sprite(i)) {
+      auto &r = rects[i];
+      r.set(gif::Point(r.x() / factor, r.y() / factor),
+            gif::Size(r.width() / factor, r.height() / factor));
+    }
+  }
 }
 
 // MARK: GameRender
@@ -159,8 +232,17 @@ gif::Size GameRender::display_size() const {
                    (field_sz.height() + 2) * cell_sz.height());
 }
 
-GameRender::GameRender(const Game &game)
-    : frame_count(0), scheme(game), g(game), gif(display_size(), 0) {
+GameRender::GameRender(const Game &game, unsigned cell_size)
+    : frame_count(0),
+      clock(0),
+      shown_time(0),
+      time_scale(1),
+      min_palette(false),
+      pending_hash(0),
+      scheme(game),
+      g(game),
+      sprites(cell_size),
+      gif(display_size(), 0) {
   gif.set_color_map(sprites.color_map());
 }
 
@@ -195,37 +277,95 @@ void GameRender::create_separate_image() {
   }
 }
 
-void GameRender::save(gif::FileDevice &file) { gif.save(file); }
+bool GameRender::save(gif::IODevice &dev) {
+  flush_frame();
+  if (min_palette) {
+    gif.reduce_palette();
+  }
+  return gif.save(dev);
+}
+
+bool GameRender::stream_to(gif::IODevice &dev) {
+  stream = std::make_unique<gif::GifWriter>(dev);
+  return stream->open(display_size(), 0, gif.color_map());
+}
+
+bool GameRender::finish() {
+  flush_frame();
+  bool ok = stream && stream->close();
+  stream.reset();
+  return ok;
+}
+
+void GameRender::advance_clock(int delay) {
+  clock += (delay + gif::delay_padding) * time_scale;
+}
+
+// Turns the time passed since the pending frame was drawn into its delay,
+// keeping rounding errors from piling up.
+int GameRender::take_delay() {
+  long delay = std::lround(clock) - shown_time - gif::delay_padding;
+  delay = std::max(0L, std::min(delay, 0xffffL - gif::delay_padding));
+  shown_time += delay + gif::delay_padding;
+  return delay;
+}
+
+// The last drawn frame is held back until the next one is drawn, so the
+// time of the frames skipped in between can still be added to its delay.
+// A frame identical to the held one only adds its time as well and never
+// gets encoded.
+void GameRender::push_frame(std::unique_ptr<gif::Image> img, int delay) {
+  uint64_t hash = img->hash();
+  if (pending && hash == pending_hash && img->same_bits(*pending)) {
+    advance_clock(delay);
+    return;
+  }
+  flush_frame();
+  pending = std::move(img);
+  pending_hash = hash;
+  advance_clock(delay);
+}
+
+void GameRender::flush_frame() {
+  if (!pending) {
+    return;
+  }
+  set_image_show_time(*pending, take_delay());
+  if (stream) {
+    stream->write(*pending);
+    pending.reset();
+  } else {
+    gif.append(std::move(pending));
+  }
+  frame_count++;
+}
 
 void GameRender::draw_frame(int delay) {
   scheme.update();
-  auto img = create_game_frame();
-  set_image_show_time(*img, delay);
-  gif.append(std::move(img));
-  frame_count++;
+  push_frame(create_game_frame(), delay);
 }
 
 void GameRender::draw_game_over(int delay) {
   scheme.update();
   auto img = create_game_frame();
   draw_game_over_msg(*img);
-  set_image_show_time(*img, delay);
-  gif.append(std::move(img));
-  frame_count++;
+  push_frame(std::move(img), delay);
 }
 
+void GameRender::skip_frame(int delay) { advance_clock(delay); }
+
 void GameRender::draw_sprite(uint8_t sprite, const gif::Point &pos,
                              gif::Image &dst) const {
   if (sprite == EmptyCell) {
     fill_rect(gif::Rect(pos, sprites.cell_size()), sprites.field_color(), dst);
   } else {
-    copy_image(sprites.image(), sprites.rect(sprite), dst, pos);
+    copy_image(sprites.image(sprite), sprites.rect(sprite), dst, pos);
   }
 }
 
 void GameRender::draw_transparent_sprite(uint8_t sprite, const gif::Point &pos,
                                          gif::Image &dst) const {
-  auto src = sprites.image();
+  auto &src = sprites.image(sprite);
   auto src_rect = sprites.rect(sprite);
   auto trn = sprites.transparent_color();
   for (unsigned y = 0; y < src_rect.height(); ++y) {
@@ -239,7 +379,7 @@ void GameRender::draw_transparent_sprite(uint8_t sprite, const gif::Point &pos,
 
 void GameRender::draw_field_border(gif::Image &dst) const {
   auto sz = g.field().size();
-  auto img = sprites.image();
+  auto &img = sprites.image(Brick);
   auto rect = sprites.rect(Brick);
   auto bw = rect.width();
   auto bh = rect.height();
@@ -264,7 +404,7 @@ gif::Point GameRender::cell_gif_pos(size_t cell_num) const {
 }
 
 void GameRender::draw_field(gif::Image &dst) const {
-  auto cells = scheme.cells();
+  auto &cells = scheme.cells();
   size_t cells_num = g.field().size().area();
   draw_field_border(dst);  // TODO: cache
   for (size_t i = 0; i < cells_num; ++i) {
@@ -297,6 +437,12 @@ int num_digits(unsigned num) {
 void GameRender::draw_score(unsigned score, gif::Image &dst) const {
   auto msg_width = sprites.rect(Score).width() +
                    sprites.rect(Digits).width() * (num_digits(score) + 1);
+  // With small cells the score doesn't fit into the top border and is
+  // left out rather than drawn over the field.
+  if (msg_width + 2 > display_size().width() ||
+      sprites.rect(Digits).height() + 5 > sprites.cell_size().height()) {
+    return;
+  }
 
   auto msg_x = (display_size().width() - msg_width) / 2;
   auto msg_y = 4;
@@ -320,6 +466,9 @@ void GameRender::draw_game_over_msg(gif::Image &dst) const {
   uint8_t sprite = GameOver;
   gif::Size ds = dst.size();
   gif::Size ss = sprites.rect(sprite).size();
+  if (ss.width() > ds.width() || ss.height() > ds.height()) {
+    return;
+  }
   gif::Point pos((ds.width() - ss.width()) / 2,
                  (ds.height() - ss.height()) / 2);
   draw_sprite(sprite, pos, dst);
@@ -42,8 +42,12 @@ class Scheme {
 
 class Sprites {
  public:
-  Sprites();
+  // cell_size is the edge of a field cell in pixels: 1, 2, 4, 8 or 16.
+  // Cell sprites smaller than 16x16 are downsampled from the sheet,
+  // text sprites always keep their native size.
+  Sprites(unsigned cell_size = 16);
   const gif::Image &image() const { return *gif.images()[0].get(); }
+  const gif::Image &image(uint8_t sprite) const;
   gif::ColorMap color_map() const { return *gif.color_map(); }
   const gif::Rect &rect(uint8_t sprite) const { return rects[sprite]; }
   gif::Size cell_size() const { return cell_sz; }
@@ -51,20 +55,33 @@ class Sprites {
   uint8_t transparent_color() const { return trans_clr; }
 
  private:
+  void scale_cells(unsigned factor);
+
   uint8_t trans_clr;
   uint8_t field_clr;
   gif::Size cell_sz;
   gif::Rect rects[64];
+  gif::Image cells;
   gif::Gif gif;
 };
 
 class GameRender {
 
  public:
-  GameRender(const Game &game);
+  GameRender(const Game &game, unsigned cell_size = 16);
+  // Delays are in 1/100 s. A skipped frame adds its time to the frame drawn
+  // before it; the time scale stretches or squeezes all of them.
   void draw_frame(int delay);
   void draw_game_over(int delay);
-  void save(gif::FileDevice &file);
+  void skip_frame(int delay);
+  void set_time_scale(double scale) { time_scale = scale; }
+  // Saves with only the colors the frames actually use.
+  void set_min_palette(bool on) { min_palette = on; }
+  bool save(gif::IODevice &dev);
+  // Writes each frame to dev as soon as its delay is known instead of
+  // keeping them all for save(); finish() ends the stream.
+  bool stream_to(gif::IODevice &dev);
+  bool finish();
 
  private:
   gif::Size display_size() const;
@@ -80,14 +97,25 @@ class GameRender {
   void draw_game_over_msg(gif::Image &dst) const;
   std::unique_ptr<gif::Image> create_game_frame() const;
   void set_image_show_time(gif::Image& img, int delay);
+  void advance_clock(int delay);
+  int take_delay();
+  void push_frame(std::unique_ptr<gif::Image> img, int delay);
+  void flush_frame();
   void create_separate_image();
 
  private:
   size_t frame_count;
+  double clock;
+  long shown_time;
+  double time_scale;
+  bool min_palette;
+  std::unique_ptr<gif::Image> pending;
+  uint64_t pending_hash;
   Scheme scheme;
   const Game &g;
   Sprites sprites;
   gif::Gif gif;
+  std::unique_ptr<gif::GifWriter> stream;
 };
 
 class AsciiRender {
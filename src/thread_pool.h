@@ -0,0 +1,112 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run one parallel loop at a time. The
+// calling thread takes part in the loop too, so a pool of size 1 has no
+// workers and runs everything inline.
+class ThreadPool {
+ public:
+  explicit ThreadPool(unsigned threads = 0) {
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 1; i < threads; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stop = true;
+    }
+    start_cv.notify_all();
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
+  ThreadPool(ThreadPool const &) = delete;
+  ThreadPool &operator=(ThreadPool const &) = delete;
+
+  unsigned size() const { return workers.size() + 1; }
+
+  // Calls fn(i) for every i in [0, count) and returns when all calls are
+  // done. Indices are handed out one at a time, so uneven items balance.
+  void parallel_for(size_t count, const std::function<void(size_t)> &fn) {
+    if (workers.empty() || count < 2) {
+      for (size_t i = 0; i < count; i++) {
+        fn(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m);
+      job = &fn;
+      total = count;
+      next = 0;
+      busy = workers.size();
+      generation++;
+    }
+    start_cv.notify_all();
+    run(fn, count);
+
+    std::unique_lock<std::mutex> lock(m);
+    done_cv.wait(lock, [this] { return busy == 0; });
+    job = nullptr;
+  }
+
+ private:
+  void run(const std::function<void(size_t)> &fn, size_t count) {
+    for (size_t i; (i = next.fetch_add(1)) < count;) {
+      fn(i);
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+    for (;;) {
+      const std::function<void(size_t)> *fn;
+      size_t count;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        start_cv.wait(lock, [&] { return stop || generation != seen; });
+        if (stop) {
+          return;
+        }
+        seen = generation;
+        fn = job;
+        count = total;
+      }
+      run(*fn, count);
+      {
+        std::lock_guard<std::mutex> lock(m);
+        if (--busy == 0) {
+          done_cv.notify_one();
+        }
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  const std::function<void(size_t)> *job = nullptr;
+  size_t total = 0;
+  std::atomic<size_t> next{0};
+  size_t busy = 0;
+  uint64_t generation = 0;
+  bool stop = false;
+};
+
+#endif  // THREAD_POOL_H
@@ -0,0 +1,56 @@
+// Checks the background writer of FileDevice: flushes with nothing
+// pending have to return, and everything written has to reach the file.
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gif.h"
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    std::fprintf(stderr, "failed: %s\n", what);
+    failures++;
+  }
+}
+
+std::string read_file(const std::string &name) {
+  std::string res;
+  FILE *f = std::fopen(name.c_str(), "rb");
+  if (!f) {
+    return res;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+    res.append(buf, n);
+  }
+  std::fclose(f);
+  return res;
+}
+
+int main() {
+  const std::string name = "file_device_test.out";
+  {
+    gif::FileDevice dev(name);
+    check(dev.open(gif::IODevice::async_write), "open");
+    check(dev.write("abc", 3) == 3, "write");
+    for (int i = 0; i < 8; i++) {
+      check(dev.flush(), "repeated flush");
+    }
+    // More than all the buffers of the writer, with flushes in between.
+    std::vector<char> big(1 << 20, 'x');
+    for (int i = 0; i < 4; i++) {
+      check(dev.write(big.data(), big.size()) == big.size(), "big write");
+      check(dev.flush(), "flush after a big write");
+      check(dev.flush(), "flush with nothing pending");
+    }
+    check(dev.close(), "close");
+  }
+  std::string data = read_file(name);
+  check(data.size() == 3 + 4 * (1 << 20), "file size");
+  check(data.compare(0, 3, "abc") == 0, "file start");
+  std::remove(name.c_str());
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+// Checks that GifReader hands out the same color maps and extensions in
+// place on a memory device as it copies out otherwise.
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "gif.h"
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    std::fprintf(stderr, "failed: %s\n", what);
+    failures++;
+  }
+}
+
+bool same_colors(const gif::ByteView &view,
+                 const std::optional<gif::ColorMap> &cm) {
+  if (!cm) {
+    return view.data == nullptr;
+  }
+  auto &colors = cm->colors();
+  if (view.len != colors.size() * 3) {
+    return false;
+  }
+  for (size_t i = 0; i < colors.size(); i++) {
+    const uint8_t *p = view.data + 3 * i;
+    if (p[0] != colors[i].r() || p[1] != colors[i].g() ||
+        p[2] != colors[i].b()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<uint8_t> make_gif() {
+  std::vector<gif::RGB> colors;
+  for (int i = 0; i < 4; i++) {
+    colors.emplace_back(i * 10, i * 20, i * 30);
+  }
+  gif::Gif g(gif::Size(4, 4), 0);
+  g.set_color_map(gif::ColorMap(2, colors));
+  for (int f = 0; f < 3; f++) {
+    auto img = std::make_unique<gif::Image>(gif::Size(4, 4));
+    std::memset(img->rbits(), f, 16);
+    img->set_extensions(
+        std::vector<gif::Extension>{gif::create_delay_mark(10 + f)});
+    g.append(std::move(img));
+  }
+  gif::BufferDevice dev;
+  dev.open();
+  check(g.save(dev), "save");
+  return dev.take();
+}
+
+int main() {
+  auto data = make_gif();
+  gif::MemDevice copied_dev, viewed_dev;
+  copied_dev.open_for_read(data.data(), data.size());
+  viewed_dev.open_for_read(data.data(), data.size());
+  gif::GifReader copied(copied_dev);
+  gif::GifReader viewed(viewed_dev, true);
+  check(!copied.in_place() && viewed.in_place(), "in_place");
+  check(copied.open() && viewed.open(), "open");
+  check(same_colors(viewed.color_map_view(), copied.color_map()),
+        "global color map");
+  check(!viewed.color_map(), "no global color map copy");
+
+  int frames = 0;
+  while (copied.next()) {
+    check(viewed.next(), "next");
+    frames++;
+    check(same_colors(viewed.frame_color_map_view(),
+                      copied.frame_color_map()),
+          "frame color map");
+    auto &views = viewed.extension_views();
+    check(viewed.extensions().empty(), "no extension copies");
+    check(views.size() == copied.extensions().size(), "extension count");
+    for (size_t i = 0; i < views.size(); i++) {
+      auto &ext = copied.extensions()[i];
+      check(views[i].function == ext.function(), "extension function");
+      // The copies saved again: introducer, function, chunks, terminator.
+      gif::BufferDevice out;
+      out.open();
+      {
+        gif::GifIO io(out);
+        check(ext.save(io), "extension save");
+      }
+      std::vector<uint8_t> expect(out.data() + 2, out.data() + out.size());
+      std::vector<uint8_t> got;
+      for (auto &chunk : views[i].chunks) {
+        check(chunk.data >= data.data() &&
+                  chunk.data + chunk.len <= data.data() + data.size(),
+              "chunk in place");
+        got.push_back(chunk.len);
+        got.insert(got.end(), chunk.data, chunk.data + chunk.len);
+      }
+      got.push_back(0);
+      check(got == expect, "extension data");
+    }
+  }
+  check(frames == 3 && !viewed.next() && viewed.at_end(), "frame count");
+  return failures ? 1 : 0;
+}